@@ -0,0 +1,146 @@
+/* Parse and free of one directory listing with N keys, fed to the
+ * streaming parser in 16 KB chunks as curl delivers them. Nodes and
+ * strings come from the response arena and go in one etcd_response_destroy.
+ *
+ * Then the parsed nodes are copied twice, into a fresh arena and with one
+ * malloc (plus two strdup) per node freed one by one, to set the work
+ * the arena took over side by side.
+ *
+ *   ./bench_arena [keys] [rounds]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "hietcd.h"
+#include "sev.h"
+
+#define BENCH_CHUNK (1024*16)
+
+static char *bench_listing(long keys, size_t *len)
+{
+    size_t cap = 128 + keys * 128, n;
+    char *s;
+    long i;
+
+    if ((s = malloc(cap)) == NULL) exit(1);
+    n = snprintf(s, cap, "{\"action\":\"get\",\"node\":{\"key\":\"/dir\",\"dir\":true,\"nodes\":[");
+    for (i = 0; i < keys; i++) {
+        n += snprintf(s + n, cap - n, "%s{\"key\":\"/dir/key-%08ld\",\"value\":\"value-%08ld\","
+                "\"modifiedIndex\":%ld,\"createdIndex\":%ld}", i ? "," : "", i, i, i + 2, i + 2);
+    }
+    n += snprintf(s + n, cap - n, "],\"modifiedIndex\":1,\"createdIndex\":1}}");
+    *len = n;
+    return s;
+}
+
+static size_t bench_arena_size(etcd_arena *arena)
+{
+    etcd_arena_chunk *c;
+    size_t size = 0;
+
+    for (c = arena->head; c != NULL; c = c->next)
+        size += c->size;
+    return size;
+}
+
+static void bench_arena_copy(etcd_response *resp, long long *alloc_us, long long *free_us)
+{
+    etcd_arena arena;
+    etcd_node *head = NULL, *node;
+    long long start;
+    long i;
+
+    etcd_arena_init(&arena);
+    start = sev_time_us();
+    for (i = 0; i < resp->nnodes; i++) {
+        if ((node = etcd_arena_alloc(&arena, sizeof(etcd_node))) == NULL) exit(1);
+        *node = resp->nodes[i];
+        if (node->key)
+            node->key = etcd_arena_strndup(&arena, node->key, strlen(node->key));
+        if (node->value)
+            node->value = etcd_arena_strndup(&arena, node->value, strlen(node->value));
+        node->snode = head;
+        head = node;
+    }
+    *alloc_us += sev_time_us() - start;
+
+    start = sev_time_us();
+    etcd_arena_destroy(&arena);
+    *free_us += sev_time_us() - start;
+}
+
+static void bench_malloc(etcd_response *resp, long long *alloc_us, long long *free_us)
+{
+    etcd_node *head = NULL, *node, *next;
+    long long start;
+    long i;
+
+    start = sev_time_us();
+    for (i = 0; i < resp->nnodes; i++) {
+        if ((node = malloc(sizeof(etcd_node))) == NULL) exit(1);
+        *node = resp->nodes[i];
+        node->key = node->key ? strdup(node->key) : NULL;
+        node->value = node->value ? strdup(node->value) : NULL;
+        node->snode = head;
+        head = node;
+    }
+    *alloc_us += sev_time_us() - start;
+
+    start = sev_time_us();
+    for (node = head; node != NULL; node = next) {
+        next = node->snode;
+        free(node->key);
+        free(node->value);
+        free(node);
+    }
+    *free_us += sev_time_us() - start;
+}
+
+int main(int argc, char **argv)
+{
+    long keys = argc > 1 ? atol(argv[1]) : 100000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 5, r;
+    long long start, parse_us = 0, free_us = 0;
+    long long aalloc_us = 0, afree_us = 0, malloc_us = 0, mfree_us = 0;
+    long long nnodes = 0;
+    size_t len, off, n, arena = 0;
+    etcd_response *resp;
+    char *body;
+
+    body = bench_listing(keys, &len);
+    for (r = 0; r < rounds; r++) {
+        if ((resp = etcd_response_create()) == NULL) exit(1);
+        start = sev_time_us();
+        for (off = 0; off < len; off += n) {
+            n = len - off < BENCH_CHUNK ? len - off : BENCH_CHUNK;
+            etcd_response_write_cb(body + off, 1, n, resp);
+        }
+        if (etcd_response_parse(resp) != ETCD_OK) {
+            fprintf(stderr, "parse failed: %s\n", resp->errmsg);
+            exit(1);
+        }
+        parse_us += sev_time_us() - start;
+        nnodes = resp->nnodes;
+        arena = bench_arena_size(&resp->arena);
+
+        bench_arena_copy(resp, &aalloc_us, &afree_us);
+        bench_malloc(resp, &malloc_us, &mfree_us);
+
+        start = sev_time_us();
+        etcd_response_destroy(resp);
+        free_us += sev_time_us() - start;
+    }
+
+    printf("%ld keys, %zu byte body, %lld nodes, %zu byte arena, %d rounds\n",
+            keys, len, nnodes, arena, rounds);
+    printf("response: parse %7.2f ms  free %6.2f ms\n",
+            parse_us / 1000.0 / rounds, free_us / 1000.0 / rounds);
+    printf("arena:    nodes %7.2f ms  free %6.2f ms\n",
+            aalloc_us / 1000.0 / rounds, afree_us / 1000.0 / rounds);
+    printf("malloc:   nodes %7.2f ms  free %6.2f ms\n",
+            malloc_us / 1000.0 / rounds, mfree_us / 1000.0 / rounds);
+    free(body);
+    return 0;
+}
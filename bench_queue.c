@@ -0,0 +1,129 @@
+/* Submission queue contention: T producer threads push N requests to one
+ * consumer thread that pops as fast as it can, through
+ *
+ *   mutex: an etcd_rq list behind a mutex, taken on both sides (the old
+ *          etcd_io_push_request/etcd_io_pop_request)
+ *   mpsc:  the lock-free etcd_mpsc
+ *
+ * push is the mean time a producer spends per push, total the wall time
+ * until the consumer has everything.
+ *
+ *   ./bench_queue [requests] [max threads]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "request.h"
+#include "sev.h"
+
+#define BENCH_MUTEX 0
+#define BENCH_MPSC 1
+
+typedef struct {
+    int mode;
+    long num; /* requests per producer */
+    etcd_rq *nodes;
+    etcd_rq list;
+    pthread_mutex_t lock;
+    etcd_mpsc q;
+    long long push_us; /* summed over producers */
+} bench;
+
+typedef struct {
+    bench *b;
+    long first;
+} producer;
+
+static void *bench_produce(void *arg)
+{
+    producer *p = arg;
+    bench *b = p->b;
+    etcd_rq *n, *last;
+    long long start = sev_time_us();
+    long i;
+
+    for (i = 0; i < b->num; i++) {
+        n = &b->nodes[p->first + i];
+        if (b->mode == BENCH_MPSC) {
+            etcd_mpsc_push(&b->q, n);
+            continue;
+        }
+        pthread_mutex_lock(&b->lock);
+        last = etcd_rq_last(&b->list);
+        etcd_rq_insert(last, n);
+        pthread_mutex_unlock(&b->lock);
+    }
+    __sync_fetch_and_add(&b->push_us, sev_time_us() - start);
+    return NULL;
+}
+
+static etcd_rq *bench_pop(bench *b)
+{
+    etcd_rq *n = NULL;
+
+    if (b->mode == BENCH_MPSC)
+        return etcd_mpsc_pop(&b->q);
+    pthread_mutex_lock(&b->lock);
+    if (!etcd_rq_empty(&b->list)) {
+        n = etcd_rq_head(&b->list);
+        etcd_rq_remove(n);
+    }
+    pthread_mutex_unlock(&b->lock);
+    return n;
+}
+
+static void bench_run(int mode, long num, int threads)
+{
+    pthread_t tids[threads];
+    producer prods[threads];
+    bench b;
+    long done = 0, total;
+    long long start, us;
+    int i;
+
+    b.mode = mode;
+    b.num = num / threads;
+    b.push_us = 0;
+    total = b.num * threads;
+    etcd_rq_init(&b.list);
+    pthread_mutex_init(&b.lock, NULL);
+    etcd_mpsc_init(&b.q);
+    if ((b.nodes = malloc(sizeof(etcd_rq) * total)) == NULL)
+        exit(1);
+
+    start = sev_time_us();
+    for (i = 0; i < threads; i++) {
+        prods[i].b = &b;
+        prods[i].first = b.num * i;
+        pthread_create(&tids[i], NULL, bench_produce, &prods[i]);
+    }
+    while (done < total) {
+        if (bench_pop(&b) != NULL)
+            done++;
+    }
+    us = sev_time_us() - start;
+    for (i = 0; i < threads; i++)
+        pthread_join(tids[i], NULL);
+
+    printf("%-5s %3d threads %8ld requests push %7.1f ns total %7.1f ns/req %6.2f Mreq/s\n",
+            mode == BENCH_MUTEX ? "mutex" : "mpsc", threads, total,
+            b.push_us * 1000.0 / total, us * 1000.0 / total, total / (double)us);
+
+    pthread_mutex_destroy(&b.lock);
+    free(b.nodes);
+}
+
+int main(int argc, char **argv)
+{
+    long num = argc > 1 ? atol(argv[1]) : 1000000;
+    int maxthreads = argc > 2 ? atoi(argv[2]) : 32;
+    int threads;
+
+    for (threads = 1; threads <= maxthreads; threads <<= 1) {
+        bench_run(BENCH_MUTEX, num, threads);
+        bench_run(BENCH_MPSC, num, threads);
+    }
+    return 0;
+}
@@ -0,0 +1,164 @@
+/* Blocking get round trip, T threads doing N gets each, through
+ *
+ *   sync:   etcd_get
+ *   future: etcd_aget + etcd_future_wait
+ *   hand:   the wrapper call sites used to roll, a mutex/condvar pair
+ *           behind etcd_set_response_proc, one request at a time
+ *
+ * Needs a server, the key does not have to exist.
+ *
+ *   ./bench_sync [server] [gets per thread] [threads]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "hietcd.h"
+#include "future.h"
+#include "log.h"
+#include "sev.h"
+
+#define BENCH_SYNC 0
+#define BENCH_FUTURE 1
+#define BENCH_HAND 2
+
+static const char *modes[] = {"sync", "future", "hand"};
+
+typedef struct {
+    etcd_client *client;
+    int mode;
+    long num;
+    long long *us; /* per get */
+} worker;
+
+/* Hand-rolled wrapper, one outstanding request per client */
+static pthread_mutex_t hand_call = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t hand_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hand_cond = PTHREAD_COND_INITIALIZER;
+static etcd_response *hand_resp;
+
+static void hand_proc(etcd_client *client, etcd_response *resp, void *userdata)
+{
+    (void)client;
+    (void)userdata;
+    pthread_mutex_lock(&hand_lock);
+    hand_resp = etcd_response_retain(resp);
+    pthread_cond_signal(&hand_cond);
+    pthread_mutex_unlock(&hand_lock);
+}
+
+static etcd_response *hand_get(etcd_client *client, const char *key)
+{
+    etcd_response *resp = NULL;
+
+    pthread_mutex_lock(&hand_call);
+    if (etcd_aget(client, key, NULL, NULL) != HIETCD_ERR) {
+        pthread_mutex_lock(&hand_lock);
+        while (hand_resp == NULL)
+            pthread_cond_wait(&hand_cond, &hand_lock);
+        resp = hand_resp;
+        hand_resp = NULL;
+        pthread_mutex_unlock(&hand_lock);
+    }
+    pthread_mutex_unlock(&hand_call);
+    return resp;
+}
+
+static etcd_response *future_get(etcd_client *client, const char *key)
+{
+    etcd_future *f;
+    etcd_response *resp;
+
+    if ((f = etcd_future_create()) == NULL)
+        return NULL;
+    if (etcd_aget(client, key, etcd_future_proc, etcd_future_retain(f)) == HIETCD_ERR) {
+        etcd_future_destroy(f);
+        etcd_future_destroy(f);
+        return NULL;
+    }
+    resp = etcd_response_retain(etcd_future_wait(f));
+    etcd_future_destroy(f);
+    return resp;
+}
+
+static void *bench_work(void *arg)
+{
+    worker *w = arg;
+    etcd_response *resp;
+    long long start;
+    long i;
+
+    for (i = 0; i < w->num; i++) {
+        start = sev_time_us();
+        if (w->mode == BENCH_SYNC)
+            resp = etcd_get(w->client, "/bench/sync", 0);
+        else if (w->mode == BENCH_FUTURE)
+            resp = future_get(w->client, "/bench/sync");
+        else
+            resp = hand_get(w->client, "/bench/sync");
+        w->us[i] = sev_time_us() - start;
+        if (resp == NULL) {
+            fprintf(stderr, "%s: get failed\n", modes[w->mode]);
+            exit(1);
+        }
+        etcd_response_destroy(resp);
+    }
+    return NULL;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void bench_run(etcd_client *client, int mode, long num, int threads)
+{
+    pthread_t tids[threads];
+    worker workers[threads];
+    long long *us, start, wall, sum = 0;
+    long i, total = num * threads;
+
+    if ((us = malloc(sizeof(long long) * total)) == NULL) exit(1);
+    start = sev_time_us();
+    for (i = 0; i < threads; i++) {
+        workers[i].client = client;
+        workers[i].mode = mode;
+        workers[i].num = num;
+        workers[i].us = us + num * i;
+        pthread_create(&tids[i], NULL, bench_work, &workers[i]);
+    }
+    for (i = 0; i < threads; i++)
+        pthread_join(tids[i], NULL);
+    wall = sev_time_us() - start;
+
+    qsort(us, total, sizeof(long long), bench_cmp);
+    for (i = 0; i < total; i++)
+        sum += us[i];
+    printf("%-6s %2d threads %6ld gets mean %6.1f us p50 %5lld us p99 %6lld us %8.0f gets/s\n",
+            modes[mode], threads, total, (double)sum / total, us[total / 2],
+            us[total * 99 / 100], total * 1e6 / wall);
+    free(us);
+}
+
+int main(int argc, char **argv)
+{
+    const char *server = argc > 1 ? argv[1] : "http://127.0.0.1:2379";
+    long num = argc > 2 ? atol(argv[2]) : 2000;
+    int threads = argc > 3 ? atoi(argv[3]) : 1;
+    etcd_client *client;
+    int mode;
+
+    etcd_set_log_level(ETCD_LOG_LEVEL_ERROR);
+    if ((client = etcd_client_create()) == NULL) return 1;
+    etcd_add_server(client, server);
+    etcd_set_response_proc(client, hand_proc, NULL);
+
+    /* Warm the connection pool */
+    bench_run(client, BENCH_SYNC, 100, threads);
+    for (mode = BENCH_SYNC; mode <= BENCH_HAND; mode++)
+        bench_run(client, mode, num, threads);
+    etcd_client_destroy(client);
+    return 0;
+}
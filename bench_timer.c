@@ -0,0 +1,90 @@
+/* sev timer backends, heap against wheel, at N live timers:
+ *
+ *   add:    N timers due in 0-999 ms
+ *   del:    every other one cancelled
+ *   expire: the rest fired by sev_process_timer, called every ms as the
+ *           io thread does, timed inside the calls only
+ *
+ *   ./bench_timer [N ...]    (default 1000 100000 1000000)
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "sev.h"
+
+static long fired;
+
+static void bench_fire(sev_pool *pool, long long id, void *data)
+{
+    (void)pool;
+    (void)id;
+    (void)data;
+    fired++;
+}
+
+static void bench_run(int tmode, long num)
+{
+    sev_pool *pool;
+    long long *ids, start, add_us, del_us, expire_us = 0;
+    unsigned int seed = 1;
+    long i, calls = 0;
+
+    if ((pool = sev_pool_create(16, tmode)) == NULL ||
+            (ids = malloc(sizeof(long long) * num)) == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    start = sev_time_us();
+    for (i = 0; i < num; i++) {
+        if ((ids[i] = sev_add_timer(pool, rand_r(&seed) % 1000, bench_fire, NULL)) == 0) {
+            fprintf(stderr, "%s: can't add timer %ld\n",
+                    tmode == SEV_TIMER_HEAP ? "heap" : "wheel", i);
+            exit(1);
+        }
+    }
+    add_us = sev_time_us() - start;
+
+    start = sev_time_us();
+    for (i = 0; i < num; i += 2)
+        sev_del_timer(pool, ids[i]);
+    del_us = sev_time_us() - start;
+
+    fired = 0;
+    while (pool->tnum > 0) {
+        start = sev_time_us();
+        sev_process_timer(pool);
+        expire_us += sev_time_us() - start;
+        calls++;
+        usleep(1000);
+    }
+
+    printf("%-5s %8ld timers add %6.1f ns del %6.1f ns expire %6.1f ns/timer (%ld calls, %.1f us/call)\n",
+            tmode == SEV_TIMER_HEAP ? "heap" : "wheel", num,
+            add_us * 1000.0 / num, del_us * 1000.0 / ((num + 1) / 2),
+            expire_us * 1000.0 / fired, calls, (double)expire_us / calls);
+
+    free(ids);
+    sev_pool_destroy(pool);
+}
+
+int main(int argc, char **argv)
+{
+    long sizes[] = {1000, 100000, 1000000};
+    int i;
+
+    if (argc > 1) {
+        for (i = 1; i < argc; i++) {
+            bench_run(SEV_TIMER_HEAP, atol(argv[i]));
+            bench_run(SEV_TIMER_WHEEL, atol(argv[i]));
+        }
+        return 0;
+    }
+    for (i = 0; i < 3; i++) {
+        bench_run(SEV_TIMER_HEAP, sizes[i]);
+        bench_run(SEV_TIMER_WHEEL, sizes[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,143 @@
+/* Burst submit: T threads push N requests to one consumer thread, which
+ * is woken either
+ *
+ *   byte:  once per request, a byte written per push and one request
+ *          popped per byte read (the old pipe protocol)
+ *   event: once per burst, only the push that finds the pending flag clear
+ *          writes to the eventfd and the consumer drains the whole queue
+ *          (etcd_notify_io_thread and etcd_io_read)
+ *
+ * Both run on the same etcd_mpsc, so only the wakeup differs.
+ *
+ *   ./bench_wakeup [requests] [threads]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "request.h"
+#include "sev.h"
+
+#define BENCH_BYTE 0
+#define BENCH_EVENT 1
+
+typedef struct {
+    int mode;
+    int rfd;
+    int wfd;
+    int notified;
+    long num; /* requests per producer */
+    etcd_mpsc q;
+    etcd_rq *nodes;
+    long writes;
+    long reads;
+} bench;
+
+typedef struct {
+    bench *b;
+    long first;
+} producer;
+
+static void *bench_produce(void *arg)
+{
+    producer *p = arg;
+    bench *b = p->b;
+    uint64_t one = 1;
+    long i, writes = 0;
+
+    for (i = 0; i < b->num; i++) {
+        etcd_mpsc_push(&b->q, &b->nodes[p->first + i]);
+        if (b->mode == BENCH_BYTE) {
+            if (write(b->wfd, "", 1) == 1) writes++;
+        } else if (__sync_bool_compare_and_swap(&b->notified, 0, 1)) {
+            if (write(b->wfd, &one, sizeof(one)) == sizeof(one)) writes++;
+        }
+    }
+    __sync_fetch_and_add(&b->writes, writes);
+    return NULL;
+}
+
+static void bench_consume(bench *b, long total)
+{
+    struct pollfd pfd = {b->rfd, POLLIN, 0};
+    uint64_t buf;
+    char c;
+    long done = 0;
+
+    while (done < total) {
+        if (poll(&pfd, 1, -1) <= 0) continue;
+        if (b->mode == BENCH_BYTE) {
+            if (read(b->rfd, &c, 1) != 1) continue;
+            b->reads++;
+            /* A byte can run ahead of its push becoming visible */
+            while (etcd_mpsc_pop(&b->q) == NULL);
+            done++;
+            continue;
+        }
+        if (read(b->rfd, &buf, sizeof(buf)) <= 0) continue;
+        b->reads++;
+        __sync_lock_release(&b->notified);
+        __sync_synchronize();
+        while (etcd_mpsc_pop(&b->q) != NULL)
+            done++;
+    }
+}
+
+static void bench_run(int mode, long num, int threads)
+{
+    pthread_t tids[threads];
+    producer prods[threads];
+    bench b;
+    int fds[2], i;
+    long long start, us;
+
+    b.mode = mode;
+    b.num = num / threads;
+    b.notified = 0;
+    b.writes = 0;
+    b.reads = 0;
+    etcd_mpsc_init(&b.q);
+    if ((b.nodes = malloc(sizeof(etcd_rq) * b.num * threads)) == NULL)
+        exit(1);
+    if (mode == BENCH_BYTE) {
+        if (pipe(fds) == -1) exit(1);
+        b.rfd = fds[0];
+        b.wfd = fds[1];
+    } else {
+        if ((b.rfd = b.wfd = eventfd(0, EFD_NONBLOCK)) == -1) exit(1);
+    }
+
+    start = sev_time_us();
+    for (i = 0; i < threads; i++) {
+        prods[i].b = &b;
+        prods[i].first = b.num * i;
+        pthread_create(&tids[i], NULL, bench_produce, &prods[i]);
+    }
+    bench_consume(&b, b.num * threads);
+    for (i = 0; i < threads; i++)
+        pthread_join(tids[i], NULL);
+    us = sev_time_us() - start;
+
+    printf("%-5s %8ld requests %3d threads %8lld us %7.1f ns/req %8ld writes %8ld wakeups\n",
+            mode == BENCH_BYTE ? "byte" : "event", b.num * threads, threads, us,
+            us * 1000.0 / (b.num * threads), b.writes, b.reads);
+
+    close(b.rfd);
+    if (b.wfd != b.rfd) close(b.wfd);
+    free(b.nodes);
+}
+
+int main(int argc, char **argv)
+{
+    long num = argc > 1 ? atol(argv[1]) : 100000;
+    int threads = argc > 2 ? atoi(argv[2]) : 1;
+
+    bench_run(BENCH_BYTE, num, threads);
+    bench_run(BENCH_EVENT, num, threads);
+    return 0;
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2014-2015, Qingbin Piao <piaoqingbin at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define etcd_arena_align(n) (((n) + ETCD_ARENA_ALIGN - 1) & ~(size_t)(ETCD_ARENA_ALIGN - 1))
+
+void etcd_arena_init(etcd_arena *arena)
+{
+    arena->head = NULL;
+    arena->chunksize = ETCD_ARENA_CHUNKSIZE;
+}
+
+void *etcd_arena_alloc(etcd_arena *arena, size_t size)
+{
+    etcd_arena_chunk *chunk = arena->head;
+    size_t csize;
+    void *p;
+
+    size = etcd_arena_align(size);
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        csize = arena->chunksize;
+        while (csize < size)
+            csize <<= 1;
+
+        if ((chunk = malloc(sizeof(etcd_arena_chunk) + csize)) == NULL)
+            return NULL;
+        chunk->size = csize;
+        chunk->used = 0;
+        chunk->next = arena->head;
+        arena->head = chunk;
+
+        if (arena->chunksize < ETCD_ARENA_MAXCHUNK)
+            arena->chunksize <<= 1;
+    }
+
+    p = chunk->data + chunk->used;
+    chunk->used += size;
+    return p;
+}
+
+char *etcd_arena_strndup(etcd_arena *arena, const char *s, size_t len)
+{
+    char *p;
+
+    if ((p = etcd_arena_alloc(arena, len + 1)) == NULL)
+        return NULL;
+    memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
+}
+
+/* Releases everything but the newest (largest) chunk, which is kept for
+ * the next round of allocations */
+void etcd_arena_reset(etcd_arena *arena)
+{
+    etcd_arena_chunk *chunk, *next;
+
+    if (arena->head == NULL) return;
+
+    chunk = arena->head->next;
+    while (chunk) {
+        next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->head->next = NULL;
+    arena->head->used = 0;
+}
+
+void etcd_arena_destroy(etcd_arena *arena)
+{
+    etcd_arena_chunk *chunk, *next;
+
+    chunk = arena->head;
+    while (chunk) {
+        next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    etcd_arena_init(arena);
+}
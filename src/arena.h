@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2014-2015, Qingbin Piao <piaoqingbin at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _HIETCD_ARENA_H_
+#define _HIETCD_ARENA_H_
+
+#include <stddef.h>
+
+#define ETCD_ARENA_CHUNKSIZE (1024*4) /* first chunk */
+#define ETCD_ARENA_MAXCHUNK (1024*1024) /* chunks stop doubling here */
+#define ETCD_ARENA_ALIGN 8
+
+/* Arena chunk */
+typedef struct etcd_arena_chunk {
+    struct etcd_arena_chunk *next;
+    size_t size; /* usable bytes in data */
+    size_t used;
+    char data[];
+} etcd_arena_chunk;
+
+/* Bump allocator, everything carved from it is released at once by
+ * etcd_arena_reset or etcd_arena_destroy */
+typedef struct {
+    etcd_arena_chunk *head; /* chunk being carved */
+    size_t chunksize; /* size of the next chunk */
+} etcd_arena;
+
+void etcd_arena_init(etcd_arena *arena);
+void *etcd_arena_alloc(etcd_arena *arena, size_t size);
+char *etcd_arena_strndup(etcd_arena *arena, const char *s, size_t len);
+void etcd_arena_reset(etcd_arena *arena);
+void etcd_arena_destroy(etcd_arena *arena);
+
+#endif
@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2014-2015, Qingbin Piao <piaoqingbin at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+
+#include "batch.h"
+#include "io.h"
+#include "log.h"
+
+static void etcd_batch_pump(etcd_batch *batch);
+static void etcd_batch_op_cb(etcd_client *client, etcd_response *resp, void *userdata);
+
+etcd_batch *etcd_batch_create(etcd_client *client, int window)
+{
+    etcd_batch *batch;
+
+    if ((batch = calloc(1, sizeof(etcd_batch))) == NULL)
+        return NULL;
+    batch->client = client;
+    batch->window = window > 0 ? window : ETCD_BATCH_WINDOW;
+    return batch;
+}
+
+/* Only for a batch that was never submitted, a submitted one is freed
+ * after its processor returns */
+void etcd_batch_destroy(etcd_batch *batch)
+{
+    int i;
+
+    for (i = 0; i < batch->num; i++) {
+        if (batch->ops[i].req)
+            etcd_request_destroy(batch->ops[i].req);
+    }
+    if (batch->ops) free(batch->ops);
+    free(batch);
+}
+
+int etcd_batch_add(etcd_batch *batch, etcd_request *req, 
+    etcd_response_proc *proc, void *userdata)
+{
+    etcd_batch_op *ops;
+    int size;
+
+    if (batch->num == batch->size) {
+        size = batch->size ? batch->size * 2 : 16;
+        if ((ops = realloc(batch->ops, size * sizeof(etcd_batch_op))) == NULL) {
+            etcd_request_destroy(req);
+            return HIETCD_ERR;
+        }
+        batch->ops = ops;
+        batch->size = size;
+    }
+    ops = &batch->ops[batch->num++];
+    ops->batch = batch;
+    ops->req = req;
+    ops->proc = proc;
+    ops->userdata = userdata;
+    return HIETCD_OK;
+}
+
+/* Called on the io thread when the batch comes off the queue */
+void etcd_batch_start(etcd_batch *batch)
+{
+    etcd_io *io = batch->client->io;
+
+    ETCD_LOG_DEBUG("Starting batch of %d", batch->num);
+    /* Tracked until done, so the io can free it if it goes first */
+    batch->iprev = NULL;
+    if ((batch->inext = io->batches) != NULL)
+        batch->inext->iprev = batch;
+    io->batches = batch;
+    etcd_batch_pump(batch);
+}
+
+/* Tops the window up. A request may complete right away (cache hit,
+ * dispatch failure), the outermost call then does the rest. */
+static void etcd_batch_pump(etcd_batch *batch)
+{
+    etcd_client *client = batch->client;
+    etcd_request *req;
+    etcd_batch_op *op;
+
+    if (batch->pumping) return;
+    batch->pumping = 1;
+    while (batch->next < batch->num && batch->inflight < batch->window) {
+        op = &batch->ops[batch->next++];
+        req = op->req;
+        op->req = NULL;
+        req->id = __sync_add_and_fetch(&client->reqseq, 1);
+        req->proc = etcd_batch_op_cb;
+        req->userdata = op;
+        req->deadline = client->deadline;
+        req->retries = client->retries;
+        /* The deadline runs from leaving the window, not from submit */
+        req->ctime = sev_time_ms();
+        batch->inflight++;
+        etcd_io_submit(client->io, req);
+    }
+    batch->pumping = 0;
+
+    if (batch->done == batch->num) {
+        if (batch->iprev)
+            batch->iprev->inext = batch->inext;
+        else
+            client->io->batches = batch->inext;
+        if (batch->inext)
+            batch->inext->iprev = batch->iprev;
+        if (batch->proc)
+            batch->proc(batch, batch->failed, batch->userdata);
+        etcd_batch_destroy(batch);
+    }
+}
+
+static void etcd_batch_op_cb(etcd_client *client, etcd_response *resp, void *userdata)
+{
+    etcd_batch_op *op = userdata;
+    etcd_batch *batch = op->batch;
+
+    if (resp->errcode != ETCD_OK)
+        batch->failed++;
+    if (op->proc)
+        op->proc(client, resp, op->userdata);
+    batch->inflight--;
+    batch->done++;
+    etcd_batch_pump(batch);
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2014-2015, Qingbin Piao <piaoqingbin at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _HIETCD_BATCH_H_
+#define _HIETCD_BATCH_H_
+
+#include "hietcd.h"
+#include "request.h"
+
+#define ETCD_BATCH_WINDOW 64 /* default number of operations in flight */
+
+typedef struct etcd_batch etcd_batch;
+
+/* Batch processor, runs once on the io thread after every operation
+ * completed. failed counts the responses with an errcode. */
+typedef void etcd_batch_proc(etcd_batch *batch, int failed, void *userdata);
+
+typedef struct etcd_batch_op {
+    etcd_batch *batch;
+    etcd_request *req; /* NULL once handed to io */
+    etcd_response_proc *proc; /* may be NULL */
+    void *userdata;
+} etcd_batch_op;
+
+/* Operations collected by one thread, then submitted as a single
+ * queue entry. The io thread keeps at most window of them in flight. */
+struct etcd_batch {
+    etcd_client *client;
+    int window;
+    int num; /* operations added */
+    int size; /* slots in ops */
+    int next; /* next operation to send */
+    int inflight;
+    int done;
+    int failed;
+    int pumping;
+    etcd_batch_op *ops;
+    etcd_batch_proc *proc;
+    void *userdata;
+    etcd_batch *iprev; /* io->batches, while running */
+    etcd_batch *inext;
+};
+
+etcd_batch *etcd_batch_create(etcd_client *client, int window);
+void etcd_batch_destroy(etcd_batch *batch);
+int etcd_batch_get(etcd_batch *batch, const char *key, 
+        etcd_response_proc *proc, void *userdata);
+int etcd_batch_set(etcd_batch *batch, const char *key, const char *value, 
+        size_t len, int ttl, etcd_response_proc *proc, void *userdata);
+int etcd_batch_delete(etcd_batch *batch, const char *key, 
+        etcd_response_proc *proc, void *userdata);
+/* Let batches finish before etcd_client_destroy, a batch still running
+ * then is freed without its processor being called */
+int etcd_batch_submit(etcd_batch *batch, etcd_batch_proc *proc, void *userdata);
+
+/* Internal */
+int etcd_batch_add(etcd_batch *batch, etcd_request *req, 
+        etcd_response_proc *proc, void *userdata);
+void etcd_batch_start(etcd_batch *batch);
+
+#endif
@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2014-2015, Qingbin Piao <piaoqingbin at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "hietcd.h"
+
+/* Invalidation of entries under a directory */
+typedef struct etcd_cache_scan {
+    const char *dir; /* with the trailing '/' */
+    size_t len;
+    long long idx; /* index of the event */
+} etcd_cache_scan;
+
+static size_t etcd_cache_key(const char *key, char *buf);
+static int etcd_cache_covers(etcd_cache *cache, const char *key, size_t len);
+static void etcd_cache_free(void *val);
+static void etcd_cache_invalidate(etcd_cache *cache, const char *key, long long idx);
+static int etcd_cache_invalidate_dir(const char *key, void *val, void *arg);
+
+etcd_cache *etcd_cache_create(const char *prefix)
+{
+    etcd_cache *cache;
+    char buf[HIETCD_URL_BUFSIZE];
+
+    if ((cache = malloc(sizeof(etcd_cache))) == NULL)
+        return NULL;
+
+    cache->plen = etcd_cache_key(prefix, buf);
+    if ((cache->prefix = strdup(buf)) == NULL) 
+        goto create_err;
+    if ((cache->keys = etcd_dict_create(etcd_cache_free)) == NULL)
+        goto create_err;
+    cache->healthy = 0;
+    cache->windex = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+    pthread_rwlock_init(&cache->lock, NULL);
+    return cache;
+
+create_err:
+    if (cache->prefix) free(cache->prefix);
+    free(cache);
+    return NULL;
+}
+
+void etcd_cache_destroy(etcd_cache *cache)
+{
+    etcd_dict_destroy(cache->keys);
+    pthread_rwlock_destroy(&cache->lock);
+    free(cache->prefix);
+    free(cache);
+}
+
+/* Returns a retained response, or NULL on a miss */
+etcd_response *etcd_cache_lookup(etcd_cache *cache, const char *key)
+{
+    etcd_response *resp = NULL;
+    char buf[HIETCD_URL_BUFSIZE];
+    size_t len = etcd_cache_key(key, buf);
+
+    if (!etcd_cache_covers(cache, buf, len)) return NULL;
+
+    pthread_rwlock_rdlock(&cache->lock);
+    if (cache->healthy && (resp = etcd_dict_get(cache->keys, buf)) != NULL)
+        etcd_response_retain(resp);
+    pthread_rwlock_unlock(&cache->lock);
+
+    if (resp)
+        __sync_fetch_and_add(&cache->hits, 1);
+    else
+        __sync_fetch_and_add(&cache->misses, 1);
+    return resp;
+}
+
+/* Keeps a successful get of key. A reply older than the watch may have
+ * missed events that were already applied, so it is not kept. */
+void etcd_cache_store(etcd_cache *cache, const char *key, etcd_response *resp)
+{
+    etcd_response *old;
+    char buf[HIETCD_URL_BUFSIZE];
+    size_t len = etcd_cache_key(key, buf);
+
+    if (!etcd_cache_covers(cache, buf, len)) return;
+
+    pthread_rwlock_wrlock(&cache->lock);
+    if (!cache->healthy || resp->idx < cache->windex) 
+        goto store_done;
+    old = etcd_dict_get(cache->keys, buf);
+    if (old != NULL && old->idx >= resp->idx) 
+        goto store_done;
+    if (old == NULL && cache->keys->used >= ETCD_CACHE_MAXKEYS)
+        goto store_done;
+    if (etcd_dict_set(cache->keys, buf, etcd_response_retain(resp)) != ETCD_DICT_OK)
+        etcd_response_destroy(resp);
+
+store_done:
+    pthread_rwlock_unlock(&cache->lock);
+}
+
+/* Drops what a watch event makes stale: the key itself, the recursive
+ * gets of its parents and, for a directory, everything below it */
+void etcd_cache_apply(etcd_cache *cache, etcd_response *resp)
+{
+    etcd_node *node = resp->node;
+    etcd_cache_scan scan;
+    char buf[HIETCD_URL_BUFSIZE], *p;
+    size_t len;
+
+    if (node == NULL || node->key == NULL) return;
+    len = etcd_cache_key(node->key, buf);
+
+    pthread_rwlock_wrlock(&cache->lock);
+    etcd_cache_invalidate(cache, buf, node->midx);
+
+    if (node->isdir && len > 1) {
+        buf[len] = '/';
+        buf[len + 1] = '\0';
+        scan.dir = buf;
+        scan.len = len + 1;
+        scan.idx = node->midx;
+        etcd_dict_scan(cache->keys, etcd_cache_invalidate_dir, &scan);
+        buf[len] = '\0';
+    }
+
+    while (len > 1 && (p = strrchr(buf, '/')) != NULL) {
+        len = p - buf;
+        if (len == 0) len = 1;
+        buf[len] = '\0';
+        etcd_cache_invalidate(cache, buf, node->midx);
+    }
+
+    if (node->midx > cache->windex)
+        cache->windex = node->midx;
+    pthread_rwlock_unlock(&cache->lock);
+}
+
+/* Empties the cache, the watch has applied everything up to idx */
+void etcd_cache_reset(etcd_cache *cache, long long idx, int healthy)
+{
+    pthread_rwlock_wrlock(&cache->lock);
+    etcd_dict_clear(cache->keys);
+    cache->windex = idx;
+    cache->healthy = healthy;
+    pthread_rwlock_unlock(&cache->lock);
+}
+
+/* "/a/b/" and "/a/b?recursive=true" are both "/a/b", the root is "/" */
+static size_t etcd_cache_key(const char *key, char *buf)
+{
+    size_t len = strcspn(key, "?");
+
+    if (len >= HIETCD_URL_BUFSIZE - 1) 
+        len = HIETCD_URL_BUFSIZE - 2;
+    while (len > 0 && key[len - 1] == '/')
+        len--;
+    if (len == 0) {
+        buf[len++] = '/';
+    } else {
+        memcpy(buf, key, len);
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+static int etcd_cache_covers(etcd_cache *cache, const char *key, size_t len)
+{
+    if (cache->plen == 1) return 1;
+    return len >= cache->plen && strncmp(key, cache->prefix, cache->plen) == 0 && 
+        (key[cache->plen] == '/' || key[cache->plen] == '\0');
+}
+
+static void etcd_cache_free(void *val)
+{
+    etcd_response_destroy(val);
+}
+
+static void etcd_cache_invalidate(etcd_cache *cache, const char *key, long long idx)
+{
+    etcd_response *resp = etcd_dict_get(cache->keys, key);
+
+    if (resp != NULL && resp->idx < idx)
+        etcd_dict_delete(cache->keys, key);
+}
+
+static int etcd_cache_invalidate_dir(const char *key, void *val, void *arg)
+{
+    etcd_cache_scan *scan = arg;
+    etcd_response *resp = val;
+
+    return resp->idx < scan->idx && strncmp(key, scan->dir, scan->len) == 0;
+}
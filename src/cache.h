@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2014-2015, Qingbin Piao <piaoqingbin at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _HIETCD_CACHE_H_
+#define _HIETCD_CACHE_H_
+
+#include <pthread.h>
+
+#include "dict.h"
+#include "response.h"
+
+#define ETCD_CACHE_MAXKEYS 65536 /* further keys are not cached */
+
+/* Read-through cache of recursive gets, keyed by etcd key. Only the io
+ * thread writes it: gets store their replies and the watch on prefix
+ * drops every entry an event touches. Cached responses are shared and
+ * must be treated as read only. */
+typedef struct etcd_cache {
+    int healthy; /* watch is current, lookups may hit */
+    long long windex; /* last etcd index applied from the watch */
+    long long hits;
+    long long misses; /* includes lookups while unhealthy */
+    char *prefix; /* normalized, "/" for the whole keyspace */
+    size_t plen;
+    etcd_dict *keys; /* key -> etcd_response */
+    pthread_rwlock_t lock;
+} etcd_cache;
+
+etcd_cache *etcd_cache_create(const char *prefix);
+void etcd_cache_destroy(etcd_cache *cache);
+etcd_response *etcd_cache_lookup(etcd_cache *cache, const char *key);
+void etcd_cache_store(etcd_cache *cache, const char *key, etcd_response *resp);
+void etcd_cache_apply(etcd_cache *cache, etcd_response *resp);
+void etcd_cache_reset(etcd_cache *cache, long long idx, int healthy);
+
+#endif
@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2014-2015, Qingbin Piao <piaoqingbin at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dict.h"
+
+static unsigned int etcd_dict_hash(const char *key);
+static int etcd_dict_expand(etcd_dict *d);
+static void etcd_dict_shrink(etcd_dict *d);
+static void etcd_dict_free_all(etcd_dict *d);
+static void etcd_dict_free_entry(etcd_dict *d, etcd_dict_entry *e);
+
+etcd_dict *etcd_dict_create(etcd_dict_free_proc *freeproc)
+{
+    etcd_dict *d;
+
+    if ((d = malloc(sizeof(etcd_dict))) == NULL)
+        return NULL;
+    if ((d->table = calloc(ETCD_DICT_MINSIZE, sizeof(etcd_dict_entry *))) == NULL) {
+        free(d);
+        return NULL;
+    }
+    d->size = ETCD_DICT_MINSIZE;
+    d->used = 0;
+    d->free = freeproc;
+    return d;
+}
+
+void etcd_dict_destroy(etcd_dict *d)
+{
+    etcd_dict_free_all(d);
+    free(d->table);
+    free(d);
+}
+
+void etcd_dict_clear(etcd_dict *d)
+{
+    etcd_dict_free_all(d);
+    etcd_dict_shrink(d);
+}
+
+static void etcd_dict_free_all(etcd_dict *d)
+{
+    etcd_dict_entry *e, *next;
+    size_t i;
+
+    for (i = 0; i < d->size && d->used > 0; i++) {
+        for (e = d->table[i]; e != NULL; e = next) {
+            next = e->next;
+            etcd_dict_free_entry(d, e);
+            d->used--;
+        }
+        d->table[i] = NULL;
+    }
+}
+
+void *etcd_dict_get(etcd_dict *d, const char *key)
+{
+    unsigned int hash = etcd_dict_hash(key);
+    etcd_dict_entry *e;
+
+    for (e = d->table[hash & (d->size - 1)]; e != NULL; e = e->next) {
+        if (e->hash == hash && strcmp(e->key, key) == 0)
+            return e->val;
+    }
+    return NULL;
+}
+
+/* Adds or replaces, a replaced value is released */
+int etcd_dict_set(etcd_dict *d, const char *key, void *val)
+{
+    unsigned int hash = etcd_dict_hash(key);
+    etcd_dict_entry *e, **bucket;
+
+    for (e = d->table[hash & (d->size - 1)]; e != NULL; e = e->next) {
+        if (e->hash == hash && strcmp(e->key, key) == 0) {
+            if (d->free && e->val != val) d->free(e->val);
+            e->val = val;
+            return ETCD_DICT_OK;
+        }
+    }
+
+    /* Keep chains short, a failed expand just makes them longer */
+    if (d->used >= d->size)
+        etcd_dict_expand(d);
+
+    if ((e = malloc(sizeof(etcd_dict_entry))) == NULL)
+        return ETCD_DICT_ERR;
+    if ((e->key = strdup(key)) == NULL) {
+        free(e);
+        return ETCD_DICT_ERR;
+    }
+    e->val = val;
+    e->hash = hash;
+    bucket = &d->table[hash & (d->size - 1)];
+    e->next = *bucket;
+    *bucket = e;
+    d->used++;
+    return ETCD_DICT_OK;
+}
+
+int etcd_dict_delete(etcd_dict *d, const char *key)
+{
+    unsigned int hash = etcd_dict_hash(key);
+    etcd_dict_entry *e, **prev;
+
+    prev = &d->table[hash & (d->size - 1)];
+    for (e = *prev; e != NULL; prev = &e->next, e = e->next) {
+        if (e->hash == hash && strcmp(e->key, key) == 0) {
+            *prev = e->next;
+            etcd_dict_free_entry(d, e);
+            d->used--;
+            etcd_dict_shrink(d);
+            return ETCD_DICT_OK;
+        }
+    }
+    return ETCD_DICT_ERR;
+}
+
+/* Visits every entry, proc must not modify the dict itself */
+void etcd_dict_scan(etcd_dict *d, etcd_dict_scan_proc *proc, void *arg)
+{
+    etcd_dict_entry *e, **prev;
+    size_t i;
+
+    for (i = 0; i < d->size; i++) {
+        prev = &d->table[i];
+        while ((e = *prev) != NULL) {
+            if (proc(e->key, e->val, arg)) {
+                *prev = e->next;
+                etcd_dict_free_entry(d, e);
+                d->used--;
+            } else {
+                prev = &e->next;
+            }
+        }
+    }
+    etcd_dict_shrink(d);
+}
+
+/* FNV-1a */
+static unsigned int etcd_dict_hash(const char *key)
+{
+    unsigned int hash = 2166136261u;
+
+    while (*key) {
+        hash ^= (unsigned char)*key++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int etcd_dict_expand(etcd_dict *d)
+{
+    etcd_dict_entry **table, *e, *next;
+    size_t size = d->size << 1, i;
+
+    if ((table = calloc(size, sizeof(etcd_dict_entry *))) == NULL)
+        return ETCD_DICT_ERR;
+
+    for (i = 0; i < d->size; i++) {
+        for (e = d->table[i]; e != NULL; e = next) {
+            next = e->next;
+            e->next = table[e->hash & (size - 1)];
+            table[e->hash & (size - 1)] = e;
+        }
+    }
+    free(d->table);
+    d->table = table;
+    d->size = size;
+    return ETCD_DICT_OK;
+}
+
+/* Back to the minimum once empty, so one burst of keys doesn't pin
+ * its table for good. A failed calloc keeps the old one. */
+static void etcd_dict_shrink(etcd_dict *d)
+{
+    etcd_dict_entry **table;
+
+    if (d->used > 0 || d->size == ETCD_DICT_MINSIZE)
+        return;
+    if ((table = calloc(ETCD_DICT_MINSIZE, sizeof(etcd_dict_entry *))) == NULL)
+        return;
+    free(d->table);
+    d->table = table;
+    d->size = ETCD_DICT_MINSIZE;
+}
+
+static void etcd_dict_free_entry(etcd_dict *d, etcd_dict_entry *e)
+{
+    if (d->free) d->free(e->val);
+    free(e->key);
+    free(e);
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2014-2015, Qingbin Piao <piaoqingbin at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _HIETCD_DICT_H_
+#define _HIETCD_DICT_H_
+
+#include <stddef.h>
+
+#define ETCD_DICT_OK 0
+#define ETCD_DICT_ERR -1
+
+#define ETCD_DICT_MINSIZE 16
+
+/* Hash table keyed by strings, the keys are copied */
+typedef struct etcd_dict_entry {
+    char *key;
+    void *val;
+    unsigned int hash;
+    struct etcd_dict_entry *next;
+} etcd_dict_entry;
+
+typedef void etcd_dict_free_proc(void *val);
+/* Return non zero to delete the entry */
+typedef int etcd_dict_scan_proc(const char *key, void *val, void *arg);
+
+typedef struct etcd_dict {
+    etcd_dict_entry **table;
+    size_t size; /* buckets, a power of two */
+    size_t used; /* entries */
+    etcd_dict_free_proc *free; /* releases values, may be NULL */
+} etcd_dict;
+
+etcd_dict *etcd_dict_create(etcd_dict_free_proc *freeproc);
+void etcd_dict_destroy(etcd_dict *d);
+void etcd_dict_clear(etcd_dict *d);
+void *etcd_dict_get(etcd_dict *d, const char *key);
+int etcd_dict_set(etcd_dict *d, const char *key, void *val);
+int etcd_dict_delete(etcd_dict *d, const char *key);
+void etcd_dict_scan(etcd_dict *d, etcd_dict_scan_proc *proc, void *arg);
+
+#endif
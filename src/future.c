@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2014-2015, Qingbin Piao <piaoqingbin at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+
+#include "hietcd.h"
+#include "future.h"
+
+etcd_future *etcd_future_create(void)
+{
+    etcd_future *f;
+    pthread_condattr_t attr;
+
+    if ((f = malloc(sizeof(etcd_future))) == NULL)
+        return NULL;
+
+    f->refcount = 1;
+    f->done = 0;
+    f->resp = NULL;
+    pthread_mutex_init(&f->lock, 0);
+    /* Timed waits run on the same clock as sev, immune to clock steps */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&f->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    return f;
+}
+
+etcd_future *etcd_future_retain(etcd_future *f)
+{
+    __sync_add_and_fetch(&f->refcount, 1);
+    return f;
+}
+
+void etcd_future_destroy(etcd_future *f)
+{
+    if (__sync_sub_and_fetch(&f->refcount, 1) > 0)
+        return;
+
+    if (f->resp) etcd_response_destroy(f->resp);
+    pthread_mutex_destroy(&f->lock);
+    pthread_cond_destroy(&f->cond);
+    free(f);
+}
+
+/* Response processor, userdata is the future to complete. Drops the
+ * reference taken for the completion. */
+void etcd_future_proc(etcd_client *client, etcd_response *resp, void *userdata)
+{
+    etcd_future *f = userdata;
+
+    HIETCD_UNUSED(client);
+
+    pthread_mutex_lock(&f->lock);
+    f->resp = etcd_response_retain(resp);
+    f->done = 1;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+
+    etcd_future_destroy(f);
+}
+
+int etcd_future_poll(etcd_future *f)
+{
+    return __sync_fetch_and_add(&f->done, 0);
+}
+
+etcd_response *etcd_future_wait(etcd_future *f)
+{
+    pthread_mutex_lock(&f->lock);
+    while (!f->done)
+        pthread_cond_wait(&f->cond, &f->lock);
+    pthread_mutex_unlock(&f->lock);
+    return f->resp;
+}
+
+/* Returns NULL if the request is still running after ms */
+etcd_response *etcd_future_wait_for(etcd_future *f, int ms)
+{
+    etcd_response *resp;
+    struct timespec ts;
+    int rc = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (long)(ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&f->lock);
+    while (!f->done && rc != ETIMEDOUT)
+        rc = pthread_cond_timedwait(&f->cond, &f->lock, &ts);
+    resp = f->done ? f->resp : NULL;
+    pthread_mutex_unlock(&f->lock);
+    return resp;
+}
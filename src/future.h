@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2014-2015, Qingbin Piao <piaoqingbin at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _HIETCD_FUTURE_H_
+#define _HIETCD_FUTURE_H_
+
+#include <pthread.h>
+
+#include "hietcd.h"
+
+/* Completion of one async request. The caller and the pending
+ * completion each hold a reference:
+ *
+ *   f = etcd_future_create();
+ *   if (etcd_aget(client, key, etcd_future_proc, etcd_future_retain(f)) == HIETCD_ERR)
+ *       etcd_future_destroy(f);
+ *   resp = etcd_future_wait(f);
+ *   ...
+ *   etcd_future_destroy(f);
+ *
+ * Waiting from a response processor deadlocks the io thread. */
+typedef struct etcd_future {
+    int refcount;
+    int done;
+    etcd_response *resp; /* owned by the future once done */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} etcd_future;
+
+etcd_future *etcd_future_create(void);
+etcd_future *etcd_future_retain(etcd_future *f);
+void etcd_future_destroy(etcd_future *f);
+void etcd_future_proc(etcd_client *client, etcd_response *resp, void *userdata);
+int etcd_future_poll(etcd_future *f);
+etcd_response *etcd_future_wait(etcd_future *f);
+etcd_response *etcd_future_wait_for(etcd_future *f, int ms);
+
+#endif
@@ -34,7 +34,11 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <stdint.h>
 #include <pthread.h>
+#ifdef HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
 
 #include <curl/curl.h>
 
@@ -42,11 +46,40 @@
 #include "log.h"
 #include "io.h"
 #include "request.h"
+#include "future.h"
+#include "cache.h"
+#include "lease.h"
+#include "batch.h"
 
+#ifndef HAVE_EVENTFD
 static int etcd_set_nonblock(int fd);
-static inline int etcd_fmt_url(etcd_client *client, const char *key, char *url);
+#endif
+static inline int etcd_fmt_path(const char *key, char *path);
 static inline int etcd_notify_io_thread(etcd_client *client);
-static inline int etcd_send_queue(etcd_client *client, etcd_request *req);
+static inline long long etcd_send_queue(etcd_client *client, etcd_request *req, 
+        etcd_response_proc *proc, void *userdata);
+static int etcd_send_control(etcd_client *client, int flag, long long id, int ms);
+static etcd_response *etcd_wait_sync(etcd_client *client, etcd_future *f, 
+        long long id, int timeout);
+static etcd_request *etcd_get_request(etcd_client *client, const char *key, int lookup);
+static etcd_request *etcd_write_request(const char *method, const char *key, 
+        const char *value, size_t len, int ttl, const etcd_cond *cond);
+static etcd_request *etcd_delete_request(const char *key);
+static long long etcd_send_get(etcd_client *client, const char *key, 
+        etcd_response_proc *proc, void *userdata, int lookup);
+static long long etcd_send_write(etcd_client *client, const char *method, const char *key, 
+        const char *value, size_t len, int ttl, const etcd_cond *cond, 
+        etcd_response_proc *proc, void *userdata);
+static char *etcd_fmt_form(const char *value, size_t len, int ttl, const etcd_cond *cond, 
+        int refresh);
+static size_t etcd_escape(char *dst, const char *src, size_t len);
+static int etcd_watch_arm(etcd_watcher *watcher);
+static void etcd_watch_track(etcd_watcher *watcher, long long id);
+static void etcd_watch_release(etcd_watcher *watcher);
+static void etcd_watch_response_cb(etcd_client *client, etcd_response *resp, void *userdata);
+static void etcd_watch_retry_cb(sev_pool *pool, long long id, void *data);
+static void etcd_cache_watch_proc(etcd_watcher *watcher, int event, 
+        etcd_response *resp, void *userdata);
 
 etcd_client *etcd_client_create(void)
 {
@@ -56,13 +89,36 @@ etcd_client *etcd_client_create(void)
         return NULL; 
 
     client->timeout = HIETCD_DEFAULT_TIMEOUT;
-    client->conntimeout = HIETCD_DEFAULT_TIMEOUT;
+    client->conntimeout = HIETCD_DEFAULT_CONNTIMEOUT;
     client->keepalive = HIETCD_DEFAULT_KEEPALIVE;
+    client->reuse = HIETCD_DEFAULT_REUSE;
+    client->poolsize = HIETCD_DEFAULT_POOLSIZE;
+    client->idletimeout = HIETCD_DEFAULT_IDLETIMEOUT;
     client->snum = 0;
+    client->policy = HIETCD_DEFAULT_POLICY;
+    client->quarantine = HIETCD_DEFAULT_QUARANTINE;
+    client->deadline = HIETCD_DEFAULT_DEADLINE;
+    client->maxinflight = HIETCD_DEFAULT_MAXINFLIGHT;
+    client->maxqueue = HIETCD_DEFAULT_MAXQUEUE;
+    client->overflow = HIETCD_DEFAULT_OVERFLOW;
+    client->adaptive = 0;
+    client->coalesce = HIETCD_DEFAULT_COALESCE;
+    client->hedge = HIETCD_DEFAULT_HEDGE;
+    client->retries = HIETCD_DEFAULT_RETRIES;
+    client->backoff = HIETCD_DEFAULT_BACKOFF;
+    client->maxbackoff = HIETCD_DEFAULT_MAXBACKOFF;
+    client->timers = HIETCD_DEFAULT_TIMERS;
+    client->reqseq = 0;
+    client->wfd = -1;
     client->certfile = NULL;
     client->io = NULL;
+    client->cache = NULL;
+    client->watchers = NULL;
+    client->leases = NULL;
+    pthread_mutex_init(&client->wlock, NULL);
     client->proc = NULL;
     client->userdata = NULL;
+    memset(&client->stats, 0, sizeof(client->stats));
 
     etcd_start_io_thread(client);
 
@@ -71,10 +127,23 @@ etcd_client *etcd_client_create(void)
 
 void etcd_client_destroy(etcd_client *client)
 {
+    etcd_watcher *w;
+
     etcd_stop_io_thread(client);
+    /* Their requests died with the io thread */
+    while ((w = client->watchers) != NULL) {
+        client->watchers = w->next;
+        w->proc(w, HIETCD_WATCH_STOPPED, NULL, w->userdata);
+        free(w->key);
+        free(w);
+    }
+    pthread_mutex_destroy(&client->wlock);
+    if (client->leases)
+        etcd_lease_sched_destroy(client->leases);
+    if (client->cache)
+        etcd_cache_destroy(client->cache);
     while (--client->snum >= 0)
         free(client->servers[client->snum]);
-    close(client->wfd);
     free(client); 
 }
 
@@ -84,6 +153,65 @@ void etcd_set_response_proc(etcd_client *client, etcd_response_proc *proc, void
     client->userdata = userdata;
 }
 
+/* Servers are read by the io thread, add them before sending requests */
+int etcd_add_server(etcd_client *client, const char *server)
+{
+    size_t len = strlen(server);
+
+    if (client->snum >= HIETCD_MAX_NODE_NUM) {
+        ETCD_LOG_ERROR("Too many servers, max %d", HIETCD_MAX_NODE_NUM);
+        return HIETCD_ERR;
+    }
+
+    /* Paths are appended as /v2/... */
+    while (len > 0 && server[len - 1] == '/')
+        len--;
+    if ((client->servers[client->snum] = strndup(server, len)) == NULL)
+        return HIETCD_ERR;
+    client->snum++;
+    return HIETCD_OK;
+}
+
+void etcd_get_stats(etcd_client *client, etcd_stats *stats)
+{
+    stats->redirects = __sync_fetch_and_add(&client->stats.redirects, 0);
+    stats->redirects_avoided = __sync_fetch_and_add(&client->stats.redirects_avoided, 0);
+    stats->leader_changes = __sync_fetch_and_add(&client->stats.leader_changes, 0);
+    stats->heartbeats = __sync_fetch_and_add(&client->stats.heartbeats, 0);
+    stats->heartbeat_us = __sync_fetch_and_add(&client->stats.heartbeat_us, 0);
+    stats->heartbeat_max_us = __sync_fetch_and_add(&client->stats.heartbeat_max_us, 0);
+    stats->dropped = __sync_fetch_and_add(&client->stats.dropped, 0);
+    stats->limit = __sync_fetch_and_add(&client->stats.limit, 0);
+    stats->coalesced = __sync_fetch_and_add(&client->stats.coalesced, 0);
+    stats->hedges = __sync_fetch_and_add(&client->stats.hedges, 0);
+    stats->hedge_wins = __sync_fetch_and_add(&client->stats.hedge_wins, 0);
+    stats->retries = __sync_fetch_and_add(&client->stats.retries, 0);
+    stats->cache_hits = stats->cache_misses = 0;
+    if (client->cache) {
+        stats->cache_hits = __sync_fetch_and_add(&client->cache->hits, 0);
+        stats->cache_misses = __sync_fetch_and_add(&client->cache->misses, 0);
+    }
+}
+
+/* Serves gets of keys under prefix (NULL for all keys) from memory, a
+ * recursive watch on prefix drops entries as they change. Enable it
+ * once, after the servers are added. */
+int etcd_enable_cache(etcd_client *client, const char *prefix)
+{
+    if (client->cache != NULL) return HIETCD_OK;
+
+    if ((client->cache = etcd_cache_create(prefix ? prefix : "/")) == NULL)
+        return HIETCD_ERR;
+    if (etcd_watch_start(client, client->cache->prefix, 0, 
+                etcd_cache_watch_proc, client->cache) == NULL) {
+        etcd_cache_destroy(client->cache);
+        client->cache = NULL;
+        return HIETCD_ERR;
+    }
+    /* The watcher lives as long as the client */
+    return HIETCD_OK;
+}
+
 int etcd_start_io_thread(etcd_client *client)
 {
     etcd_io *io;
@@ -98,13 +226,21 @@ int etcd_start_io_thread(etcd_client *client)
 
     int fds[2] = {0};
 
+#ifdef HAVE_EVENTFD
+    if ((fds[0] = fds[1] = eventfd(0, EFD_NONBLOCK)) == -1) {
+        etcd_io_destroy(io); 
+        ETCD_LOG_ERROR("Can't make an eventfd %d", errno);
+        return HIETCD_ERR;
+    }
+#else
     if (pipe(fds) == -1) {
-        free(io); 
+        etcd_io_destroy(io); 
         ETCD_LOG_ERROR("Can't make a pipe %d", errno);
         return HIETCD_ERR;
     }
     etcd_set_nonblock(fds[0]);
     etcd_set_nonblock(fds[1]);
+#endif
 
     io->rfd = fds[0];
     io->size = 10240;
@@ -130,113 +266,677 @@ void etcd_stop_io_thread(etcd_client *client)
         etcd_io_stop(client->io);
         etcd_notify_io_thread(client); 
         pthread_join(client->tid, 0);
+        if (client->wfd != client->io->rfd)
+            close(client->wfd);
+        client->wfd = -1;
         etcd_io_destroy(client->io);
         client->io = NULL;
     }
 }
 
+/* Only the first request pushed since the last drain pays for a write */
 static inline int etcd_notify_io_thread(etcd_client *client)
 {
-    return write(client->wfd, &"\0", 1) == 1 ? HIETCD_OK : HIETCD_ERR;
+#ifdef HAVE_EVENTFD
+    uint64_t buf = 1;
+#else
+    char buf = '\0';
+#endif
+
+    if (!__sync_bool_compare_and_swap(&client->io->notified, 0, 1))
+        return HIETCD_OK;
+    return write(client->wfd, &buf, sizeof(buf)) == sizeof(buf) ? 
+        HIETCD_OK : HIETCD_ERR;
 }
 
+#ifndef HAVE_EVENTFD
 static int etcd_set_nonblock(int fd)
 {
     long l = fcntl(fd, F_GETFL);
     if(l & O_NONBLOCK) return 0;
     return fcntl(fd, F_SETFL, l | O_NONBLOCK);
 }
+#endif
 
-static inline int etcd_fmt_url(etcd_client *client, const char *key, char *url) 
+static inline int etcd_fmt_path(const char *key, char *path) 
 {
-    return snprintf(url, HIETCD_URL_BUFSIZE, "%s/%s/keys%s", 
-            client->servers[0], HIETCD_SERVER_VERSION, key);
+    return snprintf(path, HIETCD_URL_BUFSIZE, "/%s/keys%s", 
+            HIETCD_SERVER_VERSION, key);
 }
 
 
-static inline int etcd_send_queue(etcd_client *client, etcd_request *req)
+static inline long long etcd_send_queue(etcd_client *client, etcd_request *req, 
+    etcd_response_proc *proc, void *userdata)
 {
+    long long id;
+
+    /* Cache hits take no room, they are answered right away */
+    if (req->resp == NULL && client->maxqueue > 0) {
+        if (etcd_io_admit(client->io) != HIETCD_OK) {
+            etcd_request_destroy(req);
+            return HIETCD_ERR;
+        }
+        req->flags |= ETCD_REQUEST_FLAG_QUEUED;
+    }
+
+    id = __sync_add_and_fetch(&client->reqseq, 1);
+    req->id = id;
+    req->proc = proc;
+    req->userdata = userdata;
+    req->deadline = client->deadline;
+    req->retries = client->retries;
+    req->ctime = sev_time_ms();
+    etcd_io_push_request(client->io, req);
+    if (etcd_notify_io_thread(client) != HIETCD_OK)
+        ETCD_LOG_ERROR("Can't notify io thread %d", errno);
+    return id;
+}
+
+/* Control requests queue up behind the requests they target, the
+ * deadline field carries their argument */
+static int etcd_send_control(etcd_client *client, int flag, long long id, int ms)
+{
+    etcd_request *req;
+
+    if ((req = etcd_request_create(NULL, 0, NULL)) == NULL)
+        return HIETCD_ERR;
+    req->flags = flag;
+    req->target = id;
+    req->deadline = ms;
     etcd_io_push_request(client->io, req);
     return etcd_notify_io_thread(client);
 }
 
-int etcd_amkdir(etcd_client *client, const char *key, int ttl)
+int etcd_cancel(etcd_client *client, long long id)
+{
+    return etcd_send_control(client, ETCD_REQUEST_FLAG_CANCEL, id, 0);
+}
+
+int etcd_set_deadline(etcd_client *client, long long id, int ms)
+{
+    return etcd_send_control(client, ETCD_REQUEST_FLAG_DEADLINE, id, ms);
+}
+
+int etcd_set_retries(etcd_client *client, long long id, int retries)
+{
+    return etcd_send_control(client, ETCD_REQUEST_FLAG_RETRIES, id, retries);
+}
+
+long long etcd_amkdir(etcd_client *client, const char *key, int ttl, 
+    etcd_response_proc *proc, void *userdata)
 {
     etcd_request *req;
-    char url[HIETCD_URL_BUFSIZE] = {0}; 
+    char path[HIETCD_URL_BUFSIZE] = {0}; 
     const char data[] = "dir=true";
     int n = 0;
     
-    n = etcd_fmt_url(client, key, url);
+    n = etcd_fmt_path(key, path);
     if (ttl > 0) 
-        n += snprintf(url + n, HIETCD_URL_BUFSIZE - n, "?ttl=%d", ttl);
+        n += snprintf(path + n, HIETCD_URL_BUFSIZE - n, "?ttl=%d", ttl);
 
-    if ((req = etcd_request_create(url, n, ETCD_REQUEST_PUT)) == NULL)
+    if ((req = etcd_request_create(path, n, ETCD_REQUEST_PUT)) == NULL)
         return HIETCD_ERR;
 
     etcd_request_dup_data(req, data, sizeof(data));
-    return etcd_send_queue(client, req);
+    return etcd_send_queue(client, req, proc, userdata);
+}
+
+long long etcd_aset(etcd_client *client, const char *key, const char *value, 
+    size_t len, int ttl, etcd_response_proc *proc, void *userdata)
+{
+    return etcd_send_write(client, ETCD_REQUEST_PUT, key, value, len, ttl, NULL, 
+            proc, userdata);
+}
+
+/* Sets key only if cond holds, in one round trip */
+long long etcd_acas(etcd_client *client, const char *key, const char *value, 
+    size_t len, int ttl, const etcd_cond *cond, etcd_response_proc *proc, void *userdata)
+{
+    return etcd_send_write(client, ETCD_REQUEST_PUT, key, value, len, ttl, cond, 
+            proc, userdata);
 }
 
-int etcd_aset(etcd_client *client, const char *key, const char *value, 
-    size_t len, int ttl)
+/* Fails with ETCD_ERRCODE_NODE_EXIST if key is already there */
+long long etcd_acreate(etcd_client *client, const char *key, const char *value, 
+    size_t len, int ttl, etcd_response_proc *proc, void *userdata)
+{
+    etcd_cond cond = {NULL, 0, HIETCD_PREV_NOEXIST};
+
+    return etcd_send_write(client, ETCD_REQUEST_PUT, key, value, len, ttl, &cond, 
+            proc, userdata);
+}
+
+/* Deletes key only if cond holds. The conditions travel in the url, so
+ * prevValue is bounded by HIETCD_URL_BUFSIZE. */
+long long etcd_acad(etcd_client *client, const char *key, const etcd_cond *cond, 
+    etcd_response_proc *proc, void *userdata)
 {
     etcd_request *req;
-    char url[HIETCD_URL_BUFSIZE] = {0}, *data = NULL; 
-    size_t datasize = len + 22; /* value=%s;ttl=%d */
+    char path[HIETCD_URL_BUFSIZE] = {0}, *form; 
     int n = 0;
-    
-    n = etcd_fmt_url(client, key, url);
-    if ((req = etcd_request_create(url, n, ETCD_REQUEST_PUT)) == NULL)
+
+    if ((form = etcd_fmt_form(NULL, 0, 0, cond, 0)) == NULL)
+        return HIETCD_ERR;
+    n = etcd_fmt_path(key, path);
+    n += snprintf(path + n, HIETCD_URL_BUFSIZE - n, "?%s", form);
+    free(form);
+    if (n >= HIETCD_URL_BUFSIZE) {
+        ETCD_LOG_ERROR("Conditions too long for %s", key);
         return HIETCD_ERR;
+    }
 
-    if ((data = malloc(datasize)) == NULL) return HIETCD_ERR;
-    n = snprintf(data, datasize, "value=%s", value);
-    if (ttl > 0) snprintf(data + n, datasize - n, ";ttl=%d", ttl);
-    etcd_request_set_data(req, data);
+    if ((req = etcd_request_create(path, n, ETCD_REQUEST_DELETE)) == NULL)
+        return HIETCD_ERR;
+    return etcd_send_queue(client, req, proc, userdata);
+}
 
-    return etcd_send_queue(client, req);
+/* Extends the ttl of an existing key without changing its value, so
+ * watchers see nothing. Fails with ETCD_ERRCODE_KEY_NOT_FOUND once the
+ * key is gone. */
+long long etcd_arefresh(etcd_client *client, const char *key, int ttl, 
+    etcd_response_proc *proc, void *userdata)
+{
+    etcd_request *req;
+    char path[HIETCD_URL_BUFSIZE] = {0}, *form; 
+    etcd_cond cond = {NULL, 0, HIETCD_PREV_EXIST};
+    int n = 0;
 
+    n = etcd_fmt_path(key, path);
+    if ((req = etcd_request_create(path, n, ETCD_REQUEST_PUT)) == NULL)
+        return HIETCD_ERR;
+    if ((form = etcd_fmt_form(NULL, 0, ttl, &cond, 1)) == NULL) {
+        etcd_request_destroy(req);
+        return HIETCD_ERR;
+    }
+    etcd_request_set_data(req, form);
+    req->flags |= ETCD_REQUEST_FLAG_IDEMPOTENT;
+    return etcd_send_queue(client, req, proc, userdata);
+}
+
+/* Creates a key with a unique, increasing name under dir, the reply
+ * node holds the key */
+long long etcd_apost(etcd_client *client, const char *dir, const char *value, 
+    size_t len, int ttl, etcd_response_proc *proc, void *userdata)
+{
+    return etcd_send_write(client, ETCD_REQUEST_POST, dir, value, len, ttl, NULL, 
+            proc, userdata);
+}
+
+long long etcd_aget(etcd_client *client, const char *key, 
+    etcd_response_proc *proc, void *userdata)
+{
+    return etcd_send_get(client, key, proc, userdata, 1);
 }
 
-int etcd_aget(etcd_client *client, const char *key)
+long long etcd_adelete(etcd_client *client, const char *key, 
+    etcd_response_proc *proc, void *userdata)
 {
     etcd_request *req;
-    char url[HIETCD_URL_BUFSIZE] = {0}; 
+
+    if ((req = etcd_delete_request(key)) == NULL)
+        return HIETCD_ERR;
+    return etcd_send_queue(client, req, proc, userdata);
+}
+
+long long etcd_awatch(etcd_client *client, const char *key, 
+    etcd_response_proc *proc, void *userdata)
+{
+    etcd_request *req;
+    char path[HIETCD_URL_BUFSIZE] = {0}; 
     int n = 0;
     
-    n = etcd_fmt_url(client, key, url);
-    n += snprintf(url + n, HIETCD_URL_BUFSIZE - n, "?recursive=true");
+    n = etcd_fmt_path(key, path);
+    n += snprintf(path + n, HIETCD_URL_BUFSIZE - n, "?wait=true&recursive=true");
+
+    if ((req = etcd_request_create(path, n, ETCD_REQUEST_GET)) == NULL)
+        return HIETCD_ERR;
+    req->flags |= ETCD_REQUEST_FLAG_WATCH;
+    return etcd_send_queue(client, req, proc, userdata);
+}
+
+/* Gets, sets and deletes collected into a batch are sent together */
+int etcd_batch_get(etcd_batch *batch, const char *key, 
+    etcd_response_proc *proc, void *userdata)
+{
+    etcd_request *req;
+
+    if ((req = etcd_get_request(batch->client, key, 1)) == NULL)
+        return HIETCD_ERR;
+    return etcd_batch_add(batch, req, proc, userdata);
+}
+
+int etcd_batch_set(etcd_batch *batch, const char *key, const char *value, 
+    size_t len, int ttl, etcd_response_proc *proc, void *userdata)
+{
+    etcd_request *req;
+
+    req = etcd_write_request(ETCD_REQUEST_PUT, key, value, len, ttl, NULL);
+    if (req == NULL)
+        return HIETCD_ERR;
+    return etcd_batch_add(batch, req, proc, userdata);
+}
+
+int etcd_batch_delete(etcd_batch *batch, const char *key, 
+    etcd_response_proc *proc, void *userdata)
+{
+    etcd_request *req;
 
-    if ((req = etcd_request_create(url, n, ETCD_REQUEST_GET)) == NULL)
+    if ((req = etcd_delete_request(key)) == NULL)
         return HIETCD_ERR;
-    return etcd_send_queue(client, req);
+    return etcd_batch_add(batch, req, proc, userdata);
 }
 
-int etcd_adelete(etcd_client *client, const char *key)
+/* One queue entry and one wakeup for the whole batch. The batch
+ * belongs to the io thread from here on and is freed after proc. On
+ * HIETCD_ERR (e.g. a full queue with HIETCD_OVERFLOW_FAIL) it still
+ * belongs to the caller. */
+int etcd_batch_submit(etcd_batch *batch, etcd_batch_proc *proc, void *userdata)
 {
     etcd_request *req;
-    char url[HIETCD_URL_BUFSIZE] = {0}; 
+
+    if ((req = etcd_request_create(NULL, 0, NULL)) == NULL)
+        return HIETCD_ERR;
+    req->flags = ETCD_REQUEST_FLAG_BATCH;
+    batch->proc = proc;
+    batch->userdata = userdata;
+    if (etcd_send_queue(batch->client, req, NULL, batch) == HIETCD_ERR) {
+        batch->proc = NULL;
+        batch->userdata = NULL;
+        return HIETCD_ERR;
+    }
+    return HIETCD_OK;
+}
+
+static long long etcd_send_write(etcd_client *client, const char *method, const char *key, 
+    const char *value, size_t len, int ttl, const etcd_cond *cond, 
+    etcd_response_proc *proc, void *userdata)
+{
+    etcd_request *req;
+
+    if ((req = etcd_write_request(method, key, value, len, ttl, cond)) == NULL)
+        return HIETCD_ERR;
+    return etcd_send_queue(client, req, proc, userdata);
+}
+
+/* Value, ttl and preconditions all go in the form body */
+static etcd_request *etcd_write_request(const char *method, const char *key, 
+    const char *value, size_t len, int ttl, const etcd_cond *cond)
+{
+    etcd_request *req;
+    char path[HIETCD_URL_BUFSIZE] = {0}, *form; 
     int n = 0;
 
-    n = etcd_fmt_url(client, key, url);
-    n += snprintf(url + n, HIETCD_URL_BUFSIZE - n, "?recursive=true");
+    n = etcd_fmt_path(key, path);
+    if ((req = etcd_request_create(path, n, method)) == NULL)
+        return NULL;
+    if ((form = etcd_fmt_form(value, len, ttl, cond, 0)) == NULL) {
+        etcd_request_destroy(req);
+        return NULL;
+    }
+    etcd_request_set_data(req, form);
+    /* Setting a value twice leaves what setting it once does. Conditional
+     * writes and posts would report a failure, or apply twice. */
+    if (cond == NULL && strcmp(method, ETCD_REQUEST_PUT) == 0)
+        req->flags |= ETCD_REQUEST_FLAG_IDEMPOTENT;
+    return req;
+}
+
+static etcd_request *etcd_delete_request(const char *key)
+{
+    char path[HIETCD_URL_BUFSIZE] = {0}; 
+    int n = 0;
+
+    n = etcd_fmt_path(key, path);
+    n += snprintf(path + n, HIETCD_URL_BUFSIZE - n, "?recursive=true");
+    return etcd_request_create(path, n, ETCD_REQUEST_DELETE);
+}
+
+/* value=..&ttl=..&prevValue=..&prevIndex=..&prevExist=..&refresh=true
+ * with only the parts that are set. value stops at len or its first NUL. */
+static char *etcd_fmt_form(const char *value, size_t len, int ttl, const etcd_cond *cond, 
+    int refresh)
+{
+    char *form;
+    size_t size = 96, n = 0; /* names, separators and numbers */
+
+    if (value) {
+        len = strnlen(value, len);
+        size += len * 3;
+    }
+    if (cond && cond->value) 
+        size += strlen(cond->value) * 3;
+    if ((form = malloc(size)) == NULL)
+        return NULL;
+
+    if (value) {
+        n += snprintf(form + n, size - n, "value=");
+        n += etcd_escape(form + n, value, len);
+    }
+    if (ttl > 0)
+        n += snprintf(form + n, size - n, "%sttl=%d", n ? "&" : "", ttl);
+    if (cond && cond->value) {
+        n += snprintf(form + n, size - n, "%sprevValue=", n ? "&" : "");
+        n += etcd_escape(form + n, cond->value, strlen(cond->value));
+    }
+    if (cond && cond->index > 0)
+        n += snprintf(form + n, size - n, "%sprevIndex=%lld", n ? "&" : "", cond->index);
+    if (cond && cond->exist != HIETCD_PREV_ANY)
+        n += snprintf(form + n, size - n, "%sprevExist=%s", n ? "&" : "", 
+                cond->exist == HIETCD_PREV_EXIST ? "true" : "false");
+    if (refresh)
+        n += snprintf(form + n, size - n, "%srefresh=true", n ? "&" : "");
+    form[n] = '\0';
+    return form;
+}
+
+/* Percent-encodes src into dst, which has room for 3 * len + 1 */
+static size_t etcd_escape(char *dst, const char *src, size_t len)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    unsigned char c;
+    size_t i, n = 0;
+
+    for (i = 0; i < len; i++) {
+        c = src[i];
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || 
+                (c >= '0' && c <= '9') || c == '-' || c == '.' || c == '_' || c == '~') {
+            dst[n++] = c;
+        } else {
+            dst[n++] = '%';
+            dst[n++] = hex[c >> 4];
+            dst[n++] = hex[c & 15];
+        }
+    }
+    dst[n] = '\0';
+    return n;
+}
+
+/* Waits out a request submitted with etcd_future_proc */
+static etcd_response *etcd_wait_sync(etcd_client *client, etcd_future *f, 
+    long long id, int timeout)
+{
+    etcd_response *resp = NULL;
+
+    if (id == HIETCD_ERR) {
+        /* The completion reference is never going to be dropped */
+        etcd_future_destroy(f);
+        goto wait_sync_done;
+    }
+
+    if (timeout > 0)
+        etcd_set_deadline(client, id, timeout);
+    resp = etcd_response_retain(etcd_future_wait(f));
+
+wait_sync_done:
+    etcd_future_destroy(f);
+    return resp;
+}
+
+etcd_response *etcd_get(etcd_client *client, const char *key, int timeout)
+{
+    etcd_response *resp;
+    etcd_future *f;
+    long long id;
+
+    /* A hit never leaves this thread */
+    if (client->cache && (resp = etcd_cache_lookup(client->cache, key)) != NULL)
+        return resp;
+
+    if ((f = etcd_future_create()) == NULL) return NULL;
+    id = etcd_send_get(client, key, etcd_future_proc, etcd_future_retain(f), 0);
+    return etcd_wait_sync(client, f, id, timeout);
+}
+
+etcd_response *etcd_set(etcd_client *client, const char *key, const char *value, 
+    size_t len, int ttl, int timeout)
+{
+    etcd_future *f;
+    long long id;
+
+    if ((f = etcd_future_create()) == NULL) return NULL;
+    id = etcd_aset(client, key, value, len, ttl, etcd_future_proc, etcd_future_retain(f));
+    return etcd_wait_sync(client, f, id, timeout);
+}
+
+etcd_response *etcd_delete(etcd_client *client, const char *key, int timeout)
+{
+    etcd_future *f;
+    long long id;
+
+    if ((f = etcd_future_create()) == NULL) return NULL;
+    id = etcd_adelete(client, key, etcd_future_proc, etcd_future_retain(f));
+    return etcd_wait_sync(client, f, id, timeout);
+}
+
+static long long etcd_send_get(etcd_client *client, const char *key, 
+    etcd_response_proc *proc, void *userdata, int lookup)
+{
+    etcd_request *req;
 
-    if ((req = etcd_request_create(url, n, ETCD_REQUEST_DELETE)) == NULL)
+    if ((req = etcd_get_request(client, key, lookup)) == NULL)
         return HIETCD_ERR;
-    return etcd_send_queue(client, req);
+    return etcd_send_queue(client, req, proc, userdata);
 }
 
-int etcd_awatch(etcd_client *client, const char *key)
+/* A cached reply still goes through the io thread, so the processor
+ * runs where it always does. lookup is 0 when the caller missed already. */
+static etcd_request *etcd_get_request(etcd_client *client, const char *key, int lookup)
 {
     etcd_request *req;
-    char url[HIETCD_URL_BUFSIZE] = {0}; 
+    char path[HIETCD_URL_BUFSIZE] = {0}; 
     int n = 0;
     
-    n = etcd_fmt_url(client, key, url);
-    n += snprintf(url + n, HIETCD_URL_BUFSIZE - n, "?wait=true&recursive=true");
+    n = etcd_fmt_path(key, path);
+    n += snprintf(path + n, HIETCD_URL_BUFSIZE - n, "?recursive=true");
+
+    if ((req = etcd_request_create(path, n, ETCD_REQUEST_GET)) == NULL)
+        return NULL;
+    if (client->cache) {
+        if (lookup) 
+            req->resp = etcd_cache_lookup(client->cache, key);
+        if (req->resp == NULL)
+            req->flags |= ETCD_REQUEST_FLAG_CACHE;
+    }
+    return req;
+}
+
+/* Watches key from index on, 0 starts with a resync. Events are
+ * delivered in order on the io thread. */
+etcd_watcher *etcd_watch_start(etcd_client *client, const char *key, long long index, 
+    etcd_watch_proc *proc, void *userdata)
+{
+    etcd_watcher *w;
 
-    if ((req = etcd_request_create(url, n, ETCD_REQUEST_GET)) == NULL)
+    if ((w = malloc(sizeof(etcd_watcher))) == NULL)
+        return NULL;
+    if ((w->key = strdup(key)) == NULL) {
+        free(w);
+        return NULL;
+    }
+    w->client = client;
+    w->refcount = 2; /* the caller and the io thread */
+    w->stopped = 0;
+    w->syncing = index <= 0;
+    w->index = index;
+    w->rid = 0;
+    w->proc = proc;
+    w->userdata = userdata;
+
+    pthread_mutex_lock(&client->wlock);
+    w->prev = NULL;
+    if ((w->next = client->watchers) != NULL)
+        w->next->prev = w;
+    client->watchers = w;
+    pthread_mutex_unlock(&client->wlock);
+
+    if (etcd_watch_arm(w) != HIETCD_OK) {
+        w->refcount = 1;
+        w->proc = NULL;
+        etcd_watch_release(w);
+        return NULL;
+    }
+    return w;
+}
+
+/* No event is delivered once the io thread has seen this, a processor
+ * may still be running when it returns. HIETCD_WATCH_STOPPED follows
+ * from whichever thread drops the last reference. */
+void etcd_watch_stop(etcd_watcher *watcher)
+{
+    __sync_fetch_and_or(&watcher->stopped, 1);
+    etcd_cancel(watcher->client, __sync_fetch_and_add(&watcher->rid, 0));
+    etcd_watch_release(watcher);
+}
+
+/* From a watch processor: the next request is a get of the key */
+void etcd_watch_resync(etcd_watcher *watcher)
+{
+    watcher->syncing = 1;
+}
+
+/* Sends the next request: a recursive get while syncing, the long poll
+ * for the next index otherwise */
+static int etcd_watch_arm(etcd_watcher *w)
+{
+    etcd_request *req;
+    char path[HIETCD_URL_BUFSIZE] = {0}; 
+    int n = 0;
+    long long id;
+
+    n = etcd_fmt_path(w->key, path);
+    if (w->syncing) {
+        n += snprintf(path + n, HIETCD_URL_BUFSIZE - n, "?recursive=true");
+    } else {
+        n += snprintf(path + n, HIETCD_URL_BUFSIZE - n, 
+                "?wait=true&recursive=true&waitIndex=%lld", w->index);
+    }
+
+    if ((req = etcd_request_create(path, n, ETCD_REQUEST_GET)) == NULL)
         return HIETCD_ERR;
-    return etcd_send_queue(client, req);
+    if (!w->syncing)
+        req->flags |= ETCD_REQUEST_FLAG_WATCH;
+    if ((id = etcd_send_queue(w->client, req, etcd_watch_response_cb, w)) == HIETCD_ERR)
+        return HIETCD_ERR;
+    etcd_watch_track(w, id);
+    return HIETCD_OK;
+}
+
+/* Publishes the request to cancel on stop. Ids only grow, so a late
+ * store from the starting thread can't hide a newer request. */
+static void etcd_watch_track(etcd_watcher *w, long long id)
+{
+    long long rid;
+
+    while ((rid = w->rid) < id && !__sync_bool_compare_and_swap(&w->rid, rid, id));
+    /* Raced with stop */
+    if (__sync_fetch_and_add(&w->stopped, 0))
+        etcd_cancel(w->client, id);
+}
+
+static void etcd_watch_release(etcd_watcher *w)
+{
+    etcd_client *client = w->client;
+
+    if (__sync_sub_and_fetch(&w->refcount, 1) > 0)
+        return;
+
+    pthread_mutex_lock(&client->wlock);
+    if (w->prev)
+        w->prev->next = w->next;
+    else
+        client->watchers = w->next;
+    if (w->next)
+        w->next->prev = w->prev;
+    pthread_mutex_unlock(&client->wlock);
+    if (w->proc)
+        w->proc(w, HIETCD_WATCH_STOPPED, NULL, w->userdata);
+    free(w->key);
+    free(w);
+}
+
+static void etcd_watch_response_cb(etcd_client *client, etcd_response *resp, void *userdata)
+{
+    etcd_watcher *w = userdata;
+    int event = HIETCD_WATCH_ERROR;
+
+    HIETCD_UNUSED(client);
+
+    if (w->stopped) goto watch_release;
+
+    if (w->syncing) {
+        /* A missing key still carries the index */
+        if (resp->ccode == CURLE_OK && resp->idx > 0 && 
+                (resp->hcode == 200 || resp->hcode == 404)) {
+            w->syncing = 0;
+            w->index = resp->idx + 1;
+            event = HIETCD_WATCH_RESYNC;
+        }
+    } else if (resp->errcode == ETCD_ERR_TIMEOUT || resp->ccode == CURLE_OPERATION_TIMEDOUT) {
+        /* Long poll ran out, nothing changed */
+        event = -1;
+    } else if (resp->ccode == CURLE_OK && resp->hcode == 200 && resp->errcode == ETCD_OK) {
+        if (resp->node != NULL) {
+            w->index = resp->node->midx + 1;
+            event = HIETCD_WATCH_EVENT;
+        } else {
+            event = -1;
+        }
+    } else if (resp->errcode == ETCD_ERRCODE_INDEX_CLEARED) {
+        /* Events up to index were cleared, start over from a get */
+        w->syncing = 1;
+        event = -1;
+    }
+
+    if (event >= 0)
+        w->proc(w, event, resp, w->userdata);
+    if (w->stopped) goto watch_release;
+
+    if (event == HIETCD_WATCH_ERROR || etcd_watch_arm(w) != HIETCD_OK) {
+        ETCD_LOG_WARN("Watch of %s failed, retrying in %d ms", w->key, HIETCD_WATCH_RETRY);
+        sev_add_timer(client->io->pool, HIETCD_WATCH_RETRY, etcd_watch_retry_cb, w);
+    }
+    return;
+
+watch_release:
+    etcd_watch_release(w);
+}
+
+static void etcd_watch_retry_cb(sev_pool *pool, long long id, void *data)
+{
+    etcd_watcher *w = data;
+
+    HIETCD_UNUSED(pool);
+    HIETCD_UNUSED(id);
+
+    if (w->stopped) {
+        etcd_watch_release(w);
+        return;
+    }
+    if (etcd_watch_arm(w) != HIETCD_OK)
+        sev_add_timer(pool, HIETCD_WATCH_RETRY, etcd_watch_retry_cb, w);
+}
+
+/* Cache coherence: a resync starts over from its snapshot, events drop
+ * what they touch and a failure bypasses the cache until the next resync */
+static void etcd_cache_watch_proc(etcd_watcher *watcher, int event, 
+    etcd_response *resp, void *userdata)
+{
+    etcd_cache *cache = userdata;
+
+    switch (event) {
+    case HIETCD_WATCH_RESYNC:
+        etcd_cache_reset(cache, resp->idx, 1);
+        if (resp->hcode == 200)
+            etcd_cache_store(cache, watcher->key, resp);
+        break;
+    case HIETCD_WATCH_EVENT:
+        etcd_cache_apply(cache, resp);
+        break;
+    case HIETCD_WATCH_STOPPED:
+        break;
+    default:
+        etcd_cache_reset(cache, 0, 0);
+        etcd_watch_resync(watcher);
+        break;
+    }
 }
@@ -53,40 +53,190 @@
 #define HIETCD_DEFAULT_TIMEOUT 30
 #define HIETCD_DEFAULT_CONNTIMEOUT 1
 #define HIETCD_DEFAULT_KEEPALIVE 1
+#define HIETCD_DEFAULT_REUSE 1
+#define HIETCD_DEFAULT_POOLSIZE 16
+#define HIETCD_DEFAULT_IDLETIMEOUT 60
+#define HIETCD_DEFAULT_POLICY HIETCD_POLICY_ROUNDROBIN
+#define HIETCD_DEFAULT_QUARANTINE 1000
+#define HIETCD_DEFAULT_DEADLINE 0
+#define HIETCD_DEFAULT_MAXINFLIGHT 0
+#define HIETCD_DEFAULT_MAXQUEUE 0
+#define HIETCD_DEFAULT_OVERFLOW HIETCD_OVERFLOW_BLOCK
+#define HIETCD_DEFAULT_COALESCE 1
+#define HIETCD_DEFAULT_HEDGE 0
+#define HIETCD_DEFAULT_RETRIES 0
+#define HIETCD_DEFAULT_BACKOFF 50
+#define HIETCD_DEFAULT_MAXBACKOFF 2000
+#define HIETCD_DEFAULT_TIMERS HIETCD_TIMERS_HEAP
+#define HIETCD_WATCH_RETRY 1000 /* ms before a failed watch is retried */
+
+/* Server selection policies */
+#define HIETCD_POLICY_ROUNDROBIN 0 /* next server in turn */
+#define HIETCD_POLICY_LEASTREQ 1 /* server with the fewest outstanding requests */
+
+/* What submitting to a full queue does */
+#define HIETCD_OVERFLOW_BLOCK 0 /* wait for room, the io thread never waits */
+#define HIETCD_OVERFLOW_FAIL 1 /* return HIETCD_ERR */
+#define HIETCD_OVERFLOW_DROP 2 /* fail the oldest waiting request with ETCD_ERR_DROPPED */
+
+/* Timer backends of the io thread */
+#define HIETCD_TIMERS_HEAP 0 /* exact to the ms, O(log n) add/cancel */
+#define HIETCD_TIMERS_WHEEL 1 /* up to 1 ms late, O(1) add/cancel, for tens of
+                                 thousands of deadlines and retries */
 
 #define HIETCD_URL_BUFSIZE 512
 
 typedef struct etcd_client etcd_client;
 
+/* prevExist of etcd_cond */
+#define HIETCD_PREV_ANY 0
+#define HIETCD_PREV_EXIST 1
+#define HIETCD_PREV_NOEXIST 2
+
+/* Preconditions of a write, zero values test nothing. A failed test
+ * completes with errcode ETCD_ERRCODE_TEST_FAILED, NODE_EXIST or
+ * KEY_NOT_FOUND. */
+typedef struct etcd_cond {
+    const char *value; /* prevValue */
+    long long index; /* prevIndex */
+    int exist; /* prevExist */
+} etcd_cond;
+
+/* Client counters, updated by the io thread */
+typedef struct etcd_stats {
+    long long redirects; /* writes that were redirected by a follower */
+    long long redirects_avoided; /* writes sent straight to the leader */
+    long long leader_changes; /* times a different leader was learned */
+    long long cache_hits; /* gets answered by the cache */
+    long long cache_misses; /* gets the cache could not answer */
+    long long heartbeats; /* lease and registration writes that succeeded */
+    long long heartbeat_us; /* their total round trip time */
+    long long heartbeat_max_us; /* the slowest of them */
+    long long dropped; /* requests refused or dropped by a full queue */
+    long long limit; /* in-flight limit now, 0 for none */
+    long long coalesced; /* gets answered by an identical one already on its way */
+    long long hedges; /* slow gets sent to a second server */
+    long long hedge_wins; /* of them, answered by the second server first */
+    long long retries; /* requests sent again after a transient failure */
+} etcd_stats;
+
 /* Response processor */
 typedef void etcd_response_proc(etcd_client *client, etcd_response *resp, void *userdata);
 
+/* Watcher events */
+#define HIETCD_WATCH_EVENT 0 /* resp holds the next change */
+#define HIETCD_WATCH_RESYNC 1 /* resp is a recursive get, events resume after it */
+#define HIETCD_WATCH_ERROR 2 /* resp holds the error, retried from the same index */
+#define HIETCD_WATCH_STOPPED 3 /* last call, resp is NULL, userdata may go */
+
+typedef struct etcd_watcher etcd_watcher;
+typedef void etcd_watch_proc(etcd_watcher *watcher, int event, etcd_response *resp, 
+        void *userdata);
+
+/* Persistent recursive watch, re-armed with waitIndex after every event */
+struct etcd_watcher {
+    etcd_client *client;
+    char *key;
+    int refcount;
+    int stopped;
+    int syncing; /* next request is a get */
+    long long index; /* next waitIndex */
+    long long rid; /* latest request id */
+    etcd_watch_proc *proc;
+    void *userdata;
+    struct etcd_watcher *prev;
+    struct etcd_watcher *next;
+};
+
 /* Etcd client structure */
 struct etcd_client {
     short timeout;
     short conntimeout;
     short keepalive;
+    short reuse; /* keep connections alive between requests */
+    short poolsize; /* max idle curl handles kept by the io thread */
+    short idletimeout; /* seconds before an idle handle is evicted */
     short snum; /* number of servers */
-    int wfd; /* writable pipe fd */
+    short policy; /* server selection policy */
+    int quarantine; /* ms a failed server is skipped, doubled per failure */
+    int deadline; /* ms a request may take from submit, 0 for none */
+    int maxinflight; /* requests sent at once, watches excluded, 0 for no limit */
+    int maxqueue; /* requests waiting to be sent, 0 for no limit */
+    short overflow; /* what a full queue does */
+    short adaptive; /* AIMD: the in-flight limit follows latency, up to maxinflight */
+    short coalesce; /* identical gets on their way share one request */
+    short hedge; /* percentile of a server's get latency after which a get is
+                    also sent to another server, 0 for never */
+    short retries; /* times a request failing transiently is sent again */
+    int backoff; /* ms, the first retry waits up to this, doubled per retry */
+    int maxbackoff; /* ms, cap of the wait */
+    short timers; /* timer backend, read when the io thread starts */
+    long long reqseq; /* last request id */
+    int wfd; /* writable notify fd */
     pthread_t tid; /* thread id */
     char *certfile;
     char *servers[HIETCD_MAX_NODE_NUM];
     struct etcd_io *io; /* io thread */
+    struct etcd_cache *cache; /* read cache, NULL unless enabled */
+    etcd_watcher *watchers; /* running watchers */
+    struct etcd_lease_sched *leases; /* io thread, leases to refresh */
+    pthread_mutex_t wlock;
     etcd_response_proc *proc;
     void *userdata;
+    etcd_stats stats;
 };
 
 etcd_client *etcd_client_create(void);
 void etcd_client_destroy(etcd_client *client);
 void etcd_set_response_proc(etcd_client *client, etcd_response_proc *proc, void *userdata);
+int etcd_add_server(etcd_client *client, const char *server);
+void etcd_get_stats(etcd_client *client, etcd_stats *stats);
+int etcd_enable_cache(etcd_client *client, const char *prefix);
 int etcd_start_io_thread(etcd_client *client);
 void etcd_stop_io_thread(etcd_client *client);
 
-/* Async api */
-int etcd_amkdir(etcd_client *client, const char *key, int ttl);
-int etcd_aset(etcd_client *client, const char *key, const char *value, size_t len, int ttl);
-int etcd_aget(etcd_client *client, const char *key);
-int etcd_adelete(etcd_client *client, const char *key);
-int etcd_awatch(etcd_client *client, const char *key);
+/* Async api, a NULL proc falls back to the client's response processor.
+ * Returns a request id (> 0) or HIETCD_ERR. */
+long long etcd_amkdir(etcd_client *client, const char *key, int ttl, 
+        etcd_response_proc *proc, void *userdata);
+long long etcd_aset(etcd_client *client, const char *key, const char *value, size_t len, int ttl, 
+        etcd_response_proc *proc, void *userdata);
+long long etcd_aget(etcd_client *client, const char *key, 
+        etcd_response_proc *proc, void *userdata);
+long long etcd_adelete(etcd_client *client, const char *key, 
+        etcd_response_proc *proc, void *userdata);
+long long etcd_awatch(etcd_client *client, const char *key, 
+        etcd_response_proc *proc, void *userdata);
+long long etcd_acas(etcd_client *client, const char *key, const char *value, size_t len, 
+        int ttl, const etcd_cond *cond, etcd_response_proc *proc, void *userdata);
+long long etcd_acreate(etcd_client *client, const char *key, const char *value, size_t len, 
+        int ttl, etcd_response_proc *proc, void *userdata);
+long long etcd_acad(etcd_client *client, const char *key, const etcd_cond *cond, 
+        etcd_response_proc *proc, void *userdata);
+long long etcd_apost(etcd_client *client, const char *dir, const char *value, size_t len, 
+        int ttl, etcd_response_proc *proc, void *userdata);
+long long etcd_arefresh(etcd_client *client, const char *key, int ttl, 
+        etcd_response_proc *proc, void *userdata);
+
+/* Stop watchers before destroying the client */
+etcd_watcher *etcd_watch_start(etcd_client *client, const char *key, long long index, 
+        etcd_watch_proc *proc, void *userdata);
+void etcd_watch_stop(etcd_watcher *watcher);
+void etcd_watch_resync(etcd_watcher *watcher);
+
+/* Both act asynchronously on the io thread, a request that is still
+ * running then completes with ETCD_ERR_CANCELED or ETCD_ERR_TIMEOUT */
+int etcd_cancel(etcd_client *client, long long id);
+int etcd_set_deadline(etcd_client *client, long long id, int ms);
+/* Overrides client->retries for one request that is still running */
+int etcd_set_retries(etcd_client *client, long long id, int retries);
+
+/* Sync api, built on etcd_future. timeout is in ms, 0 keeps the client
+ * deadline. Returns a response for the caller to etcd_response_destroy,
+ * or NULL if the request could not be sent. */
+etcd_response *etcd_get(etcd_client *client, const char *key, int timeout);
+etcd_response *etcd_set(etcd_client *client, const char *key, const char *value, size_t len, 
+        int ttl, int timeout);
+etcd_response *etcd_delete(etcd_client *client, const char *key, int timeout);
 
 #endif
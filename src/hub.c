@@ -0,0 +1,293 @@
+/*
+ * Copyright (c) 2014-2015, Qingbin Piao <piaoqingbin at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "hub.h"
+
+static const char *etcd_hub_segment(const char **key, size_t *len);
+static int etcd_hub_covers(const char *prefix, const char *key);
+static etcd_hub_node *etcd_hub_child(etcd_hub_node *node, const char *name, size_t len);
+static void etcd_hub_notify(etcd_hub_node *node, int event, etcd_response *resp);
+static void etcd_hub_notify_tree(etcd_hub_node *node, int event, etcd_response *resp);
+static void etcd_hub_fanout(etcd_hub *hub, etcd_response *resp);
+static void etcd_hub_sweep(etcd_hub_node *node);
+static void etcd_hub_kill(etcd_hub_node *node);
+static void etcd_hub_free(etcd_hub *hub);
+static void etcd_hub_watch_proc(etcd_watcher *watcher, int event, 
+        etcd_response *resp, void *userdata);
+
+etcd_hub *etcd_hub_create(etcd_client *client, const char *prefix)
+{
+    etcd_hub *hub;
+    pthread_mutexattr_t attr;
+
+    if ((hub = calloc(1, sizeof(etcd_hub))) == NULL)
+        return NULL;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&hub->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    if ((hub->watcher = etcd_watch_start(client, prefix, 0, 
+                    etcd_hub_watch_proc, hub)) == NULL) {
+        pthread_mutex_destroy(&hub->lock);
+        free(hub);
+        return NULL;
+    }
+    return hub;
+}
+
+/* Subscribers are not called once this returns, the hub itself is
+ * freed when its watcher stops */
+void etcd_hub_destroy(etcd_hub *hub)
+{
+    pthread_mutex_lock(&hub->lock);
+    hub->closing = 1;
+    pthread_mutex_unlock(&hub->lock);
+    etcd_watch_stop(hub->watcher);
+}
+
+/* Events for key and everything below it, key must be under the hub prefix */
+etcd_hub_sub *etcd_hub_subscribe(etcd_hub *hub, const char *key, 
+    etcd_hub_proc *proc, void *userdata)
+{
+    etcd_hub_node *node, *child;
+    etcd_hub_sub *sub;
+    const char *name;
+    size_t len;
+
+    if (!etcd_hub_covers(hub->watcher->key, key)) 
+        return NULL;
+    if ((sub = malloc(sizeof(etcd_hub_sub))) == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&hub->lock);
+    node = &hub->root;
+    while ((name = etcd_hub_segment(&key, &len)) != NULL) {
+        if ((child = etcd_hub_child(node, name, len)) == NULL) {
+            if ((child = calloc(1, sizeof(etcd_hub_node))) == NULL || 
+                    (child->name = strndup(name, len)) == NULL) {
+                /* Nodes made so far go with the next sweep */
+                free(child);
+                free(sub);
+                sub = NULL;
+                goto subscribe_done;
+            }
+            child->parent = node;
+            child->next = node->child;
+            node->child = child;
+        }
+        node = child;
+    }
+
+    sub->dead = 0;
+    sub->hub = hub;
+    sub->node = node;
+    sub->proc = proc;
+    sub->userdata = userdata;
+    sub->next = node->subs;
+    node->subs = sub;
+
+subscribe_done:
+    pthread_mutex_unlock(&hub->lock);
+    return sub;
+}
+
+/* Safe from a subscriber processor */
+void etcd_hub_unsubscribe(etcd_hub_sub *sub)
+{
+    etcd_hub *hub = sub->hub;
+
+    pthread_mutex_lock(&hub->lock);
+    sub->dead = 1;
+    hub->dead++;
+    if (!hub->dispatching) {
+        etcd_hub_sweep(&hub->root);
+        hub->dead = 0;
+    }
+    pthread_mutex_unlock(&hub->lock);
+}
+
+/* Next segment of *key, NULL at its end */
+static const char *etcd_hub_segment(const char **key, size_t *len)
+{
+    const char *p = *key;
+
+    while (*p == '/') p++;
+    if (*p == '\0') return NULL;
+    *len = strcspn(p, "/");
+    *key = p + *len;
+    return p;
+}
+
+static int etcd_hub_covers(const char *prefix, const char *key)
+{
+    const char *ps, *ks;
+    size_t plen, klen;
+
+    while ((ps = etcd_hub_segment(&prefix, &plen)) != NULL) {
+        if ((ks = etcd_hub_segment(&key, &klen)) == NULL || 
+                klen != plen || strncmp(ps, ks, plen) != 0)
+            return 0;
+    }
+    return 1;
+}
+
+static etcd_hub_node *etcd_hub_child(etcd_hub_node *node, const char *name, size_t len)
+{
+    etcd_hub_node *child;
+
+    for (child = node->child; child != NULL; child = child->next) {
+        if (strncmp(child->name, name, len) == 0 && child->name[len] == '\0')
+            return child;
+    }
+    return NULL;
+}
+
+static void etcd_hub_notify(etcd_hub_node *node, int event, etcd_response *resp)
+{
+    etcd_hub_sub *sub;
+
+    for (sub = node->subs; sub != NULL; sub = sub->next) {
+        if (!sub->dead)
+            sub->proc(sub, event, resp, sub->userdata);
+    }
+}
+
+static void etcd_hub_notify_tree(etcd_hub_node *node, int event, etcd_response *resp)
+{
+    etcd_hub_node *child;
+
+    etcd_hub_notify(node, event, resp);
+    for (child = node->child; child != NULL; child = child->next)
+        etcd_hub_notify_tree(child, event, resp);
+}
+
+/* Subscribers of the changed key and of its parents, and of everything
+ * below it when a directory changed */
+static void etcd_hub_fanout(etcd_hub *hub, etcd_response *resp)
+{
+    etcd_hub_node *node = &hub->root, *child;
+    const char *key = resp->node->key, *name;
+    size_t len;
+
+    etcd_hub_notify(node, HIETCD_WATCH_EVENT, resp);
+    while ((name = etcd_hub_segment(&key, &len)) != NULL) {
+        if ((node = etcd_hub_child(node, name, len)) == NULL) 
+            return;
+        etcd_hub_notify(node, HIETCD_WATCH_EVENT, resp);
+    }
+
+    if (resp->node->isdir) {
+        for (child = node->child; child != NULL; child = child->next)
+            etcd_hub_notify_tree(child, HIETCD_WATCH_EVENT, resp);
+    }
+}
+
+/* Frees dead subscriptions and the nodes left without any */
+static void etcd_hub_sweep(etcd_hub_node *node)
+{
+    etcd_hub_sub **sp = &node->subs, *sub;
+    etcd_hub_node **np = &node->child, *child;
+
+    while ((sub = *sp) != NULL) {
+        if (sub->dead) {
+            *sp = sub->next;
+            free(sub);
+        } else {
+            sp = &sub->next;
+        }
+    }
+
+    while ((child = *np) != NULL) {
+        etcd_hub_sweep(child);
+        if (child->subs == NULL && child->child == NULL) {
+            *np = child->next;
+            free(child->name);
+            free(child);
+        } else {
+            np = &child->next;
+        }
+    }
+}
+
+static void etcd_hub_kill(etcd_hub_node *node)
+{
+    etcd_hub_node *child;
+    etcd_hub_sub *sub;
+
+    for (sub = node->subs; sub != NULL; sub = sub->next)
+        sub->dead = 1;
+    for (child = node->child; child != NULL; child = child->next)
+        etcd_hub_kill(child);
+}
+
+static void etcd_hub_free(etcd_hub *hub)
+{
+    etcd_hub_kill(&hub->root);
+    etcd_hub_sweep(&hub->root);
+    pthread_mutex_destroy(&hub->lock);
+    free(hub);
+}
+
+static void etcd_hub_watch_proc(etcd_watcher *watcher, int event, 
+    etcd_response *resp, void *userdata)
+{
+    etcd_hub *hub = userdata;
+
+    HIETCD_UNUSED(watcher);
+
+    if (event == HIETCD_WATCH_STOPPED) {
+        etcd_hub_free(hub);
+        return;
+    }
+
+    pthread_mutex_lock(&hub->lock);
+    if (hub->closing) goto watch_proc_done;
+
+    hub->dispatching = 1;
+    if (event == HIETCD_WATCH_EVENT) {
+        if (resp->node != NULL && resp->node->key != NULL)
+            etcd_hub_fanout(hub, resp);
+    } else {
+        etcd_hub_notify_tree(&hub->root, event, resp);
+    }
+    hub->dispatching = 0;
+    if (hub->dead) {
+        etcd_hub_sweep(&hub->root);
+        hub->dead = 0;
+    }
+
+watch_proc_done:
+    pthread_mutex_unlock(&hub->lock);
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2014-2015, Qingbin Piao <piaoqingbin at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _HIETCD_HUB_H_
+#define _HIETCD_HUB_H_
+
+#include <pthread.h>
+
+#include "hietcd.h"
+
+typedef struct etcd_hub etcd_hub;
+typedef struct etcd_hub_sub etcd_hub_sub;
+
+/* Subscriber processor, runs on the io thread with the events of
+ * etcd_watch_proc. Resyncs and errors reach every subscriber, a resync
+ * carries the snapshot of the whole hub prefix. */
+typedef void etcd_hub_proc(etcd_hub_sub *sub, int event, etcd_response *resp, void *userdata);
+
+/* Prefix trie node, one per key segment */
+typedef struct etcd_hub_node {
+    char *name; /* segment, NULL for the root */
+    struct etcd_hub_node *parent;
+    struct etcd_hub_node *child; /* first child */
+    struct etcd_hub_node *next; /* next sibling */
+    etcd_hub_sub *subs;
+} etcd_hub_node;
+
+struct etcd_hub_sub {
+    int dead; /* unsubscribed, freed by the next sweep */
+    etcd_hub *hub;
+    etcd_hub_node *node;
+    etcd_hub_proc *proc;
+    void *userdata;
+    etcd_hub_sub *next;
+};
+
+/* One upstream watch on prefix, fanned out to any number of local
+ * subscribers of keys below it */
+struct etcd_hub {
+    int closing;
+    int dispatching; /* io thread is calling subscribers */
+    int dead; /* subscriptions waiting for a sweep */
+    etcd_watcher *watcher;
+    etcd_hub_node root; /* "/" */
+    pthread_mutex_t lock; /* recursive, processors may (un)subscribe */
+};
+
+/* Destroy hubs before the client */
+etcd_hub *etcd_hub_create(etcd_client *client, const char *prefix);
+void etcd_hub_destroy(etcd_hub *hub);
+etcd_hub_sub *etcd_hub_subscribe(etcd_hub *hub, const char *key, 
+        etcd_hub_proc *proc, void *userdata);
+void etcd_hub_unsubscribe(etcd_hub_sub *sub);
+
+#endif
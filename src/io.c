@@ -32,6 +32,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
 
 #include <curl/curl.h>
 
@@ -41,19 +42,56 @@
 #include "request.h"
 #include "response.h"
 #include "hietcd.h"
+#include "cache.h"
+#include "dict.h"
+#include "batch.h"
 
 static const char *actstr[] = {"none", "IN", "OUT", "INOUT", "REMOVE"};
 
 static void etcd_io_cron(sev_pool *pool); 
 static void etcd_io_read(sev_pool *pool, int fd, void *data, int flgs);
-static void etcd_io_dispatch(etcd_io *io, etcd_request *req);
+static int etcd_io_dispatch(etcd_io *io, etcd_request *req);
 static int etcd_io_sock_cb(CURL *ch, curl_socket_t s, int what, 
         void *cbp, void *sockp);
 static int etcd_io_multi_timer_cb(CURLM *cmh, long timeout_ms, etcd_io *io);
 static void etcd_io_timer_cb(sev_pool *pool, long long id, void *data);
 static void etcd_io_event_cb(sev_pool *pool, int fd, void *data, int flgs);
-static void etcd_io_response_cb(etcd_io *io, etcd_response *resp);
+static void etcd_io_response_cb(etcd_io *io, etcd_request *req);
 static void etcd_io_check_info(etcd_io *io);
+static CURL *etcd_io_handle_get(etcd_io *io);
+static void etcd_io_handle_put(etcd_io *io, CURL *ch);
+static void etcd_io_handle_evict(etcd_io *io, time_t now);
+static int etcd_io_endpoint_pick(etcd_io *io, etcd_request *req);
+static int etcd_io_failover(etcd_io *io, etcd_request *req, CURLcode code);
+static int etcd_io_book(etcd_io *io, etcd_request *req, CURLcode code);
+static int etcd_io_endpoint_find(etcd_io *io, const char *url);
+static void etcd_io_leader_lookup(etcd_io *io);
+static void etcd_io_leader_update(etcd_io *io, etcd_request *req, long redirects, int ep);
+static void etcd_io_control(etcd_io *io, etcd_request *ctl);
+static void etcd_io_deadline_cb(sev_pool *pool, long long id, void *data);
+static void etcd_io_abort(etcd_io *io, etcd_request *req, int errcode, const char *errmsg);
+static void etcd_io_complete(etcd_io *io, etcd_request *req);
+static void etcd_io_reject(etcd_io *io, etcd_request *req, int errcode, const char *errmsg);
+static void etcd_io_send(etcd_io *io, etcd_request *req);
+static void etcd_io_dequeue(etcd_io *io, etcd_request *req);
+static void etcd_io_drain(etcd_io *io);
+static void etcd_io_trim(etcd_io *io);
+static int etcd_io_limit(etcd_io *io);
+static int etcd_io_share(etcd_io *io, etcd_request *req);
+static void etcd_io_unshare(etcd_io *io, etcd_request *req);
+static void etcd_io_fanout(etcd_io *io, etcd_request *req);
+static void etcd_io_handoff(etcd_io *io, etcd_request *req);
+static etcd_request *etcd_io_find(etcd_rq *list, long long id);
+static void etcd_io_free_list(etcd_rq *list);
+static void etcd_io_adapt(etcd_io *io, etcd_request *req, int overload);
+static void etcd_io_latency(etcd_io *io, int ep, long long us);
+static long long etcd_io_percentile(etcd_io *io, int ep, int pct);
+static void etcd_io_hedge_cb(sev_pool *pool, long long id, void *data);
+static etcd_request *etcd_io_hedge_settle(etcd_io *io, etcd_request *req, CURLcode code);
+static void etcd_io_hedge_stop(etcd_io *io, etcd_request *req);
+static void etcd_io_hedge_drop(etcd_io *io, etcd_request *copy);
+static int etcd_io_retry(etcd_io *io, etcd_request *req);
+static void etcd_io_retry_cb(sev_pool *pool, long long id, void *data);
 
 etcd_io *etcd_io_create(void)
 {
@@ -61,117 +99,986 @@ etcd_io *etcd_io_create(void)
     
     if (!(io = malloc(sizeof(etcd_io))))
         return NULL;
+    if (!(io->gets = etcd_dict_create(NULL))) {
+        free(io);
+        return NULL;
+    }
 
     io->ready = 0;
     io->rfd = -1;
+    io->notified = 0;
     io->size = -1;
     io->running = 0;
     io->tid = -1;
     io->pool = NULL;
     io->cmh = NULL;
+    io->hnum = 0;
+    io->hmaxnum = 0;
+    io->handles = NULL;
+    io->epnum = 0;
+    io->rrnext = 0;
+    io->endpoints = NULL;
+    io->leader = -1;
+    io->lookup = 0;
+    io->ltime = 0;
+    io->rterm = -1;
     io->elt.tv_sec = 0;
     io->elt.tv_usec = 0;
-    etcd_rq_init(&io->rq);
-    pthread_mutex_init(&io->rqlock, NULL);
+    etcd_mpsc_init(&io->rq);
+    etcd_rq_init(&io->inflight);
+    etcd_rq_init(&io->backlog);
+    etcd_rq_init(&io->delayed);
+    io->seed = 0;
+    io->batches = NULL;
+    io->limit = 0;
+    io->active = 0;
+    io->grow = 0;
+    io->rttmin = 0;
+    io->rttbase = 0;
+    io->cutoff = 0;
+    io->queued = 0;
+    io->qwaiters = 0;
 
     pthread_cond_init(&io->cond, 0);
     pthread_mutex_init(&io->lock, 0);
+    pthread_cond_init(&io->qcond, 0);
+    pthread_mutex_init(&io->qlock, 0);
 
     return io;
 }
 
 void etcd_io_destroy(etcd_io *io)
 {
-    if (io->pool) 
-        sev_pool_destroy(io->pool);
+    etcd_request *req;
+    etcd_batch *batch;
+
+    while ((req = etcd_io_pop_request(io)) != NULL) {
+        if (req->flags & ETCD_REQUEST_FLAG_BATCH)
+            etcd_batch_destroy(req->userdata);
+        etcd_request_destroy(req);
+    }
+    etcd_io_free_list(&io->backlog);
+    etcd_io_free_list(&io->delayed);
+    while (!etcd_rq_empty(&io->inflight)) {
+        req = etcd_rq_getreq(etcd_rq_head(&io->inflight));
+        etcd_rq_remove(&req->rq);
+        if (req->ch) {
+            curl_multi_remove_handle(io->cmh, req->ch);
+            curl_easy_cleanup(req->ch);
+        }
+        if (req->hedge && req->hedge->ch) {
+            curl_multi_remove_handle(io->cmh, req->hedge->ch);
+            curl_easy_cleanup(req->hedge->ch);
+        }
+        if (req->hedge)
+            etcd_request_destroy(req->hedge);
+        etcd_io_free_list(&req->waiters);
+        etcd_request_destroy(req);
+    }
+    /* Their requests are gone, nothing completes them any more */
+    while (io->batches != NULL) {
+        batch = io->batches;
+        io->batches = batch->inext;
+        etcd_batch_destroy(batch);
+    }
+    etcd_dict_destroy(io->gets);
+    while (io->hnum > 0)
+        curl_easy_cleanup(io->handles[--io->hnum].ch);
+    if (io->handles)
+        free(io->handles);
+    if (io->endpoints)
+        free(io->endpoints);
+    /* Closing connections calls back into the pool */
     if (io->cmh)
         curl_multi_cleanup(io->cmh);
-    pthread_mutex_destroy(&io->rqlock);
+    if (io->pool) 
+        sev_pool_destroy(io->pool);
     pthread_mutex_destroy(&io->lock);
     pthread_cond_destroy(&io->cond);
+    pthread_mutex_destroy(&io->qlock);
+    pthread_cond_destroy(&io->qcond);
     close(io->rfd);
     free(io);
 }
 
 static void etcd_io_read(sev_pool *pool, int fd, void *data, int flgs)
 {
-    char buf[1];
+    etcd_io *io = (etcd_io *) data;
+    etcd_request *req;
+#ifdef HAVE_EVENTFD
+    uint64_t buf;
+#else
+    char buf[64];
+#endif
 
     HIETCD_UNUSED(pool);
     HIETCD_UNUSED(flgs);
 
-    if (read(fd, buf, sizeof(buf)) == 1) {
-        etcd_io *io = (etcd_io *) data;
-        etcd_request *req;
+    if (read(fd, &buf, sizeof(buf)) <= 0)
+        return;
+
+    /* Requests pushed from now on must wake us up again */
+    __sync_lock_release(&io->notified);
+    __sync_synchronize();
 
-        req = etcd_io_pop_request(io);
-        if (req != NULL) {
-            ETCD_LOG_DEBUG("etcd_io_pop_request: %s", req->url);
-            etcd_io_dispatch(io, req);
+    while ((req = etcd_io_pop_request(io)) != NULL) {
+        if (req->flags & (ETCD_REQUEST_FLAG_CANCEL|ETCD_REQUEST_FLAG_DEADLINE|
+                    ETCD_REQUEST_FLAG_RETRIES)) {
+            etcd_io_control(io, req);
             etcd_request_destroy(req);
+            continue;
         }
+        if (req->flags & ETCD_REQUEST_FLAG_BATCH) {
+            /* A batch takes room as one request, its window does the rest */
+            etcd_io_dequeue(io, req);
+            etcd_batch_start(req->userdata);
+            etcd_request_destroy(req);
+            continue;
+        }
+        etcd_io_submit(io, req);
     }
+    etcd_io_trim(io);
 }
 
-static void etcd_io_cron(sev_pool *pool) 
+/* Sends a request, parks it until a slot frees up, or completes it
+ * right away. io thread only. */
+void etcd_io_submit(etcd_io *io, etcd_request *req)
 {
-    HIETCD_UNUSED(pool);
+    etcd_rq *last;
+    long long ms;
+
+    ETCD_LOG_DEBUG("etcd_io_submit: %s", req->path);
+    if (req->resp != NULL) {
+        /* Served from the cache */
+        etcd_io_dequeue(io, req);
+        etcd_io_response_cb(io, req);
+        etcd_request_destroy(req);
+        return;
+    }
+
+    /* Requests handed off by an aborted get are armed already */
+    if (req->deadline > 0 && req->tid < 0) {
+        ms = req->ctime + req->deadline - sev_time_ms();
+        req->tid = sev_add_timer(io->pool, ms > 0 ? ms : 0, etcd_io_deadline_cb, req);
+    }
+
+    if (etcd_io_share(io, req))
+        return;
+
+    /* Watches are long polls, not load, and never wait for a slot */
+    if (etcd_io_limit(io) > 0 && !(req->flags & ETCD_REQUEST_FLAG_WATCH) && 
+            (io->active >= io->limit || !etcd_rq_empty(&io->backlog))) {
+        /* etcd_rq_insert evaluates its head more than once */
+        last = etcd_rq_last(&io->backlog);
+        etcd_rq_insert(last, &req->rq);
+        return;
+    }
+    etcd_io_send(io, req);
 }
 
-static void etcd_io_dispatch(etcd_io *io, etcd_request *req)
+static void etcd_io_send(etcd_io *io, etcd_request *req)
 {
-    CURL *ch;
-    CURLMcode code;
+    if (etcd_io_dispatch(io, req) != HIETCD_OK)
+        etcd_io_reject(io, req, ETCD_ERR, "can't dispatch request");
+}
+
+/* Producer side of the bounded queue, takes room for one request.
+ * The io thread itself is let through, it would wait on itself. */
+int etcd_io_admit(etcd_io *io)
+{
+    etcd_client *client = io->client;
+    int max = client->maxqueue;
+
+    if (__sync_add_and_fetch(&io->queued, 1) <= max || 
+            client->overflow == HIETCD_OVERFLOW_DROP || 
+            pthread_equal(pthread_self(), client->tid))
+        return HIETCD_OK;
+
+    if (client->overflow == HIETCD_OVERFLOW_FAIL) {
+        __sync_sub_and_fetch(&io->queued, 1);
+        __sync_fetch_and_add(&client->stats.dropped, 1);
+        return HIETCD_ERR;
+    }
+
+    do {
+        __sync_sub_and_fetch(&io->queued, 1);
+        pthread_mutex_lock(&io->qlock);
+        /* Pairs with the check in etcd_io_dequeue */
+        __sync_fetch_and_add(&io->qwaiters, 1);
+        while (__sync_fetch_and_add(&io->queued, 0) >= max)
+            pthread_cond_wait(&io->qcond, &io->qlock);
+        __sync_fetch_and_sub(&io->qwaiters, 1);
+        pthread_mutex_unlock(&io->qlock);
+    } while (__sync_add_and_fetch(&io->queued, 1) > max);
+    return HIETCD_OK;
+}
+
+/* Gives back the room a request took in the queue */
+static void etcd_io_dequeue(etcd_io *io, etcd_request *req)
+{
+    if (!(req->flags & ETCD_REQUEST_FLAG_QUEUED))
+        return;
+    req->flags &= ~ETCD_REQUEST_FLAG_QUEUED;
+    __sync_sub_and_fetch(&io->queued, 1);
+    if (__sync_fetch_and_add(&io->qwaiters, 0) > 0) {
+        pthread_mutex_lock(&io->qlock);
+        pthread_cond_broadcast(&io->qcond);
+        pthread_mutex_unlock(&io->qlock);
+    }
+}
+
+/* Sends waiting requests while there are free slots */
+static void etcd_io_drain(etcd_io *io)
+{
+    etcd_request *req;
+
+    /* A limit turned off lets everything go */
+    while (!etcd_rq_empty(&io->backlog) && 
+            (etcd_io_limit(io) == 0 || io->active < io->limit)) {
+        req = etcd_rq_getreq(etcd_rq_head(&io->backlog));
+        etcd_rq_remove(&req->rq);
+        etcd_io_send(io, req);
+    }
+}
+
+/* HIETCD_OVERFLOW_DROP: fails the oldest waiting requests until the
+ * queue is back within maxqueue */
+static void etcd_io_trim(etcd_io *io)
+{
+    etcd_client *client = io->client;
+    etcd_request *req;
+    etcd_rq *q, *next;
+
+    if (client->maxqueue <= 0 || client->overflow != HIETCD_OVERFLOW_DROP)
+        return;
+
+    for (q = etcd_rq_head(&io->backlog); q != &io->backlog && 
+            __sync_fetch_and_add(&io->queued, 0) > client->maxqueue; q = next) {
+        next = etcd_rq_next(q);
+        req = etcd_rq_getreq(q);
+        if (!(req->flags & ETCD_REQUEST_FLAG_QUEUED)) 
+            continue;
+        etcd_rq_remove(q);
+        __sync_fetch_and_add(&client->stats.dropped, 1);
+        etcd_io_reject(io, req, ETCD_ERR_DROPPED, "dropped by a full queue");
+    }
+}
+
+/* Attaches a get to an identical one already on its way, 1 if it did */
+static int etcd_io_share(etcd_io *io, etcd_request *req)
+{
+    etcd_request *first;
+    etcd_rq *last;
+
+    if (strcmp(req->method, ETCD_REQUEST_GET) != 0) {
+        /* A get submitted before a write must not answer one submitted after it */
+        if (io->gets->used > 0)
+            etcd_dict_clear(io->gets);
+        return 0;
+    }
+    /* A retried get that still leads */
+    if (!io->client->coalesce || (req->flags & (ETCD_REQUEST_FLAG_WATCH|ETCD_REQUEST_FLAG_SHARED)))
+        return 0;
+
+    if ((first = etcd_dict_get(io->gets, req->path)) == NULL) {
+        if (etcd_dict_set(io->gets, req->path, req) == ETCD_DICT_OK)
+            req->flags |= ETCD_REQUEST_FLAG_SHARED;
+        return 0;
+    }
+
+    last = etcd_rq_last(&first->waiters);
+    etcd_rq_insert(last, &req->rq);
+    etcd_io_dequeue(io, req);
+    __sync_fetch_and_add(&io->client->stats.coalesced, 1);
+    return 1;
+}
+
+/* Books a get latency against a server. Halving every bucket once the
+ * window is full keeps the distribution recent. */
+static void etcd_io_latency(etcd_io *io, int ep, long long us)
+{
+    etcd_io_endpoint *endpoint;
+    int b, i;
+
+    if (ep < 0 || ep >= io->epnum) return;
+    endpoint = &io->endpoints[ep];
+
+    if (us < 1) us = 1;
+    b = 63 - __builtin_clzll((unsigned long long)us);
+    i = b < 2 ? b * 4 : b * 4 + (int)((us >> (b - 2)) & 3);
+    if (i >= ETCD_IO_HIST_SIZE) i = ETCD_IO_HIST_SIZE - 1;
+
+    if (++endpoint->samples > ETCD_IO_HIST_WINDOW) {
+        endpoint->samples = 0;
+        for (b = 0; b < ETCD_IO_HIST_SIZE; b++) {
+            endpoint->hist[b] /= 2;
+            endpoint->samples += endpoint->hist[b];
+        }
+        endpoint->samples++;
+    }
+    endpoint->hist[i]++;
+}
+
+/* pct percentile of the get latency of a server in ms, rounded up to
+ * the bucket bound, -1 before there are enough samples */
+static long long etcd_io_percentile(etcd_io *io, int ep, int pct)
+{
+    etcd_io_endpoint *endpoint = &io->endpoints[ep];
+    unsigned int want, seen = 0;
+    int i, b;
+
+    if (endpoint->samples < ETCD_IO_HEDGE_SAMPLES) return -1;
+    if (pct > 100) pct = 100;
+    want = (endpoint->samples * pct + 99) / 100;
+    for (i = 0; i < ETCD_IO_HIST_SIZE - 1; i++) {
+        if ((seen += endpoint->hist[i]) >= want) break;
+    }
+    b = i / 4;
+    if (b < 2)
+        return ((1LL << (b + 1)) + 999) / 1000;
+    return (((long long)(4 + i % 4 + 1) << (b - 2)) + 999) / 1000;
+}
+
+/* The get has not been answered within the percentile, a duplicate
+ * goes to a server it has not been sent to */
+static void etcd_io_hedge_cb(sev_pool *pool, long long id, void *data)
+{
+    etcd_io *io = pool->data;
+    etcd_request *req = data, *copy;
+
+    HIETCD_UNUSED(id);
+
+    req->htid = -1;
+    if (req->ch == NULL || req->hedge != NULL) return;
+
+    copy = etcd_request_create(req->path, strlen(req->path), req->method);
+    if (copy == NULL) return;
+    copy->id = req->id;
+    copy->flags = ETCD_REQUEST_FLAG_HEDGE;
+    copy->tried = req->tried;
+    if (etcd_io_dispatch(io, copy) != HIETCD_OK) {
+        etcd_request_destroy(copy);
+        return;
+    }
+    copy->hedge = req;
+    req->hedge = copy;
+    __sync_fetch_and_add(&io->client->stats.hedges, 1);
+}
+
+/* One copy of a hedged get finished. The first to succeed, with a
+ * reply below 500, or the last to fail completes the get; the other
+ * copy is stopped. Returns the get to complete, holding the result, or
+ * NULL while the other copy is still worth waiting for. */
+static etcd_request *etcd_io_hedge_settle(etcd_io *io, etcd_request *req, CURLcode code)
+{
+    etcd_request *orig, *copy, *other = req->hedge;
     etcd_response *resp;
+    int won;
 
-    if ((resp = etcd_response_create()) == NULL) {
-        ETCD_LOG_ERROR("Failed to create response");
+    orig = (req->flags & ETCD_REQUEST_FLAG_HEDGE) ? other : req;
+    copy = orig->hedge;
+    won = code == CURLE_OK && req->resp->hcode < 500;
+
+    if (!won && other->ch != NULL) {
+        /* Its server is booked as failover would have */
+        etcd_io_book(io, req, code);
+        if (req == copy) {
+            orig->hedge = NULL;
+            etcd_request_destroy(copy);
+        }
+        /* A failed original waits for its copy */
+        return NULL;
+    }
+
+    if (other->ch != NULL)
+        etcd_io_hedge_stop(io, other);
+    if (req == copy) {
+        /* The copy's result becomes the original's */
+        resp = orig->resp;
+        orig->resp = copy->resp;
+        copy->resp = resp;
+        orig->ep = copy->ep;
+        orig->stime = copy->stime;
+        orig->tried |= copy->tried;
+        if (won)
+            __sync_fetch_and_add(&io->client->stats.hedge_wins, 1);
+    }
+    orig->hedge = NULL;
+    etcd_request_destroy(copy);
+    return orig;
+}
+
+/* Puts a request that failed transiently back on the queue after a
+ * backoff, 1 if it did. Only failures that may pass are retried, and
+ * only requests that are safe to repeat unless they never reached a
+ * server. The wait is drawn from the whole backoff window (full
+ * jitter), so clients failing together do not come back together. */
+static int etcd_io_retry(etcd_io *io, etcd_request *req)
+{
+    etcd_client *client = io->client;
+    etcd_response *resp = req->resp;
+    long long window, delay;
+    int reached;
+
+    if (req->attempts >= req->retries || 
+            (req->flags & (ETCD_REQUEST_FLAG_WATCH|ETCD_REQUEST_FLAG_LEADER)))
+        return 0;
+    switch (resp->ccode) {
+    case CURLE_OK:
+        if (resp->hcode < 500 && resp->errcode != ETCD_ERRCODE_RAFT_INTERNAL)
+            return 0;
+        break;
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_GOT_NOTHING:
+        break;
+    default:
+        /* A bad url, tls setup, out of memory... the same next time */
+        return 0;
+    }
+    reached = resp->ccode != CURLE_COULDNT_CONNECT && 
+        resp->ccode != CURLE_COULDNT_RESOLVE_HOST;
+    if (reached && strcmp(req->method, ETCD_REQUEST_GET) != 0 && 
+            !(req->flags & ETCD_REQUEST_FLAG_IDEMPOTENT))
+        return 0;
+
+    if (io->seed == 0)
+        io->seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+    window = (long long)client->backoff << (req->attempts < 16 ? req->attempts : 16);
+    if (window > client->maxbackoff) window = client->maxbackoff;
+    delay = window > 0 ? rand_r(&io->seed) % window : 0;
+    /* The deadline would end it first, report the real error */
+    if (req->deadline > 0 && sev_time_ms() + delay >= req->ctime + req->deadline)
+        return 0;
+
+    ETCD_LOG_WARN("Retrying %s in %lld ms (%d/%d)", req->path, delay, 
+            req->attempts + 1, req->retries);
+    /* Back to how it was submitted, followers stay attached */
+    etcd_rq_remove(&req->rq);
+    if (req->flags & ETCD_REQUEST_FLAG_SLOT) {
+        req->flags &= ~ETCD_REQUEST_FLAG_SLOT;
+        io->active--;
+    }
+    if (req->htid >= 0) {
+        sev_del_timer(io->pool, req->htid);
+        req->htid = -1;
+    }
+    etcd_response_destroy(req->resp);
+    req->resp = NULL;
+    req->ep = -1;
+    req->tried = 0;
+    req->attempts++;
+    etcd_rq_insert(&io->delayed, &req->rq);
+    req->rtid = sev_add_timer(io->pool, delay, etcd_io_retry_cb, req);
+    __sync_fetch_and_add(&client->stats.retries, 1);
+    etcd_io_drain(io);
+    return 1;
+}
+
+static void etcd_io_retry_cb(sev_pool *pool, long long id, void *data)
+{
+    etcd_request *req = data;
+
+    HIETCD_UNUSED(id);
+
+    req->rtid = -1;
+    etcd_rq_remove(&req->rq);
+    etcd_io_submit(pool->data, req);
+}
+
+/* Ends the transfer of a copy that lost */
+static void etcd_io_hedge_stop(etcd_io *io, etcd_request *req)
+{
+    curl_multi_remove_handle(io->cmh, req->ch);
+    etcd_io_handle_put(io, req->ch);
+    req->ch = NULL;
+    io->endpoints[req->ep].inflight--;
+}
+
+static void etcd_io_hedge_drop(etcd_io *io, etcd_request *copy)
+{
+    if (copy->ch != NULL)
+        etcd_io_hedge_stop(io, copy);
+    copy->hedge->hedge = NULL;
+    etcd_request_destroy(copy);
+}
+
+/* Later gets of the same path start a request of their own */
+static void etcd_io_unshare(etcd_io *io, etcd_request *req)
+{
+    if ((req->flags & ETCD_REQUEST_FLAG_SHARED) && 
+            etcd_dict_get(io->gets, req->path) == req)
+        etcd_dict_delete(io->gets, req->path);
+    req->flags &= ~ETCD_REQUEST_FLAG_SHARED;
+}
+
+/* Answers the gets waiting on req with its reply, parsed just once */
+static void etcd_io_fanout(etcd_io *io, etcd_request *req)
+{
+    etcd_request *w;
+
+    while (!etcd_rq_empty(&req->waiters)) {
+        w = etcd_rq_getreq(etcd_rq_head(&req->waiters));
+        etcd_rq_remove(&w->rq);
+        if (req->resp == NULL) {
+            etcd_io_reject(io, w, ETCD_ERR, "can't dispatch request");
+            continue;
+        }
+        if (w->tid >= 0)
+            sev_del_timer(io->pool, w->tid);
+        w->resp = etcd_response_retain(req->resp);
+        etcd_io_response_cb(io, w);
+        etcd_request_destroy(w);
+    }
+}
+
+/* req was cancelled or timed out, which says nothing about the gets
+ * waiting on it: they are submitted again, the first one leading */
+static void etcd_io_handoff(etcd_io *io, etcd_request *req)
+{
+    etcd_request *w;
+
+    etcd_io_unshare(io, req);
+    while (!etcd_rq_empty(&req->waiters)) {
+        w = etcd_rq_getreq(etcd_rq_head(&req->waiters));
+        etcd_rq_remove(&w->rq);
+        etcd_io_submit(io, w);
+    }
+}
+
+static etcd_request *etcd_io_find(etcd_rq *list, long long id)
+{
+    etcd_request *req;
+    etcd_rq *q, *w;
+
+    for (q = etcd_rq_head(list); q != list; q = etcd_rq_next(q)) {
+        req = etcd_rq_getreq(q);
+        if (req->id == id) return req;
+        for (w = etcd_rq_head(&req->waiters); w != &req->waiters; w = etcd_rq_next(w)) {
+            if (etcd_rq_getreq(w)->id == id) 
+                return etcd_rq_getreq(w);
+        }
+    }
+    return NULL;
+}
+
+static void etcd_io_free_list(etcd_rq *list)
+{
+    etcd_request *req;
+
+    while (!etcd_rq_empty(list)) {
+        req = etcd_rq_getreq(etcd_rq_head(list));
+        etcd_rq_remove(&req->rq);
+        etcd_io_free_list(&req->waiters);
+        etcd_request_destroy(req);
+    }
+}
+
+/* maxinflight may change at any time, the adaptive limit stays below it */
+static int etcd_io_limit(etcd_io *io)
+{
+    etcd_client *client = io->client;
+    int max = client->maxinflight > 0 ? client->maxinflight : 0;
+
+    if (io->limit > max || io->limit == 0 || !client->adaptive) {
+        if (io->limit != max)
+            __sync_lock_test_and_set(&client->stats.limit, max);
+        io->limit = max;
+    }
+    return io->limit;
+}
+
+/* AIMD: the limit grows by one after a full window of completions
+ * within tolerance, and is cut by a tenth, at most once per round
+ * trip, on overload */
+static void etcd_io_adapt(etcd_io *io, etcd_request *req, int overload)
+{
+    etcd_client *client = io->client;
+    long long now = sev_time_ms();
+    long long rtt = sev_time_us() - req->stime;
+
+    if (!client->adaptive || etcd_io_limit(io) <= 0)
         return;
+
+    if (io->rttmin == 0 || rtt < io->rttmin || now - io->rttbase > ETCD_IO_AIMD_BASELINE) {
+        io->rttmin = rtt;
+        io->rttbase = now;
     }
 
-    ch = curl_easy_init();
-    if (!ch) {
-        ETCD_LOG_ERROR("Failed to init curl handler");
-        goto io_dispatch_err;
+    if (overload || rtt > io->rttmin * ETCD_IO_AIMD_TOLERANCE) {
+        io->grow = 0;
+        if (now < io->cutoff) return;
+        io->limit = io->limit * 9 / 10;
+        if (io->limit < 1) io->limit = 1;
+        io->cutoff = now + rtt / 1000;
+    } else if (io->active + 1 >= io->limit && io->limit < client->maxinflight) {
+        /* Only grow while the limit is what holds requests back */
+        if (++io->grow >= io->limit) {
+            io->limit++;
+            io->grow = 0;
+        }
     }
+    __sync_lock_test_and_set(&client->stats.limit, io->limit);
+}
 
+static void etcd_io_cron(sev_pool *pool) 
+{
+    etcd_io *io = pool->data;
+
+    if (io->hnum > 0)
+        etcd_io_handle_evict(io, time(NULL));
+}
+
+static CURL *etcd_io_handle_get(etcd_io *io)
+{
+    CURL *ch;
+
+    if (io->hnum > 0)
+        return io->handles[--io->hnum].ch;
+
+    if ((ch = curl_easy_init()) == NULL)
+        return NULL;
+
+    /* Options shared by every request, set once per handle */
     //curl_easy_setopt(ch, CURLOPT_VERBOSE, 1L);
     curl_easy_setopt(ch, CURLOPT_NOSIGNAL, 1L);
-    curl_easy_setopt(ch, CURLOPT_FORBID_REUSE, 1);
+    curl_easy_setopt(ch, CURLOPT_FORBID_REUSE, io->client->reuse ? 0L : 1L);
     curl_easy_setopt(ch, CURLOPT_FOLLOWLOCATION, 1L);
     curl_easy_setopt(ch, CURLOPT_POSTREDIR, CURL_REDIR_POST_ALL);
-    curl_easy_setopt(ch, CURLOPT_TIMEOUT, io->client->timeout);
-    curl_easy_setopt(ch, CURLOPT_CONNECTTIMEOUT, io->client->conntimeout);
-#ifdef CURLOPT_TCP_KEEPALIVE
-    curl_easy_setopt(ch, CURLOPT_TCP_KEEPALIVE, io->client->keepalive);
+#if LIBCURL_VERSION_NUM >= 0x071900
+    curl_easy_setopt(ch, CURLOPT_TCP_KEEPALIVE, (long)io->client->keepalive);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x074100
+    if (io->client->reuse && io->client->idletimeout > 0)
+        curl_easy_setopt(ch, CURLOPT_MAXAGE_CONN, (long)io->client->idletimeout);
 #endif
     curl_easy_setopt(ch, CURLOPT_NOPROGRESS, 1L);
-
-    curl_easy_setopt(ch, CURLOPT_URL, req->url);
-    curl_easy_setopt(ch, CURLOPT_CUSTOMREQUEST, req->method);
-    curl_easy_setopt(ch, CURLOPT_HEADERDATA, resp);
     curl_easy_setopt(ch, CURLOPT_HEADERFUNCTION, etcd_response_header_cb);
     curl_easy_setopt(ch, CURLOPT_WRITEFUNCTION, etcd_response_write_cb);
-    curl_easy_setopt(ch, CURLOPT_WRITEDATA, (void *)resp->data);
-    curl_easy_setopt(ch, CURLOPT_ERRORBUFFER, resp->errmsg);
-    curl_easy_setopt(ch, CURLOPT_PRIVATE, resp);
+
+    return ch;
+}
+
+static void etcd_io_handle_put(etcd_io *io, CURL *ch)
+{
+    etcd_io_handle *handles;
+
+    if (!io->client->reuse || io->hnum >= io->client->poolsize)
+        goto handle_put_cleanup;
+
+    if (io->hnum >= io->hmaxnum) {
+        int hmaxnum = io->hmaxnum ? io->hmaxnum << 1 : 4;
+        handles = realloc(io->handles, sizeof(etcd_io_handle) * hmaxnum);
+        if (handles == NULL) goto handle_put_cleanup;
+        io->handles = handles;
+        io->hmaxnum = hmaxnum;
+    }
+
+    /* Drop references to the finished response */
+    curl_easy_setopt(ch, CURLOPT_HEADERDATA, NULL);
+    curl_easy_setopt(ch, CURLOPT_WRITEDATA, NULL);
+    curl_easy_setopt(ch, CURLOPT_ERRORBUFFER, NULL);
+    curl_easy_setopt(ch, CURLOPT_PRIVATE, NULL);
+
+    io->handles[io->hnum].ch = ch;
+    io->handles[io->hnum].atime = time(NULL);
+    io->hnum++;
+    return;
+
+handle_put_cleanup:
+    curl_easy_cleanup(ch);
+}
+
+/* Handles are stacked by release time, so the idle ones sit at the bottom */
+static void etcd_io_handle_evict(etcd_io *io, time_t now)
+{
+    int i, n = 0;
+
+    while (n < io->hnum && now - io->handles[n].atime >= io->client->idletimeout)
+        n++;
+    if (n == 0) return;
+
+    ETCD_LOG_DEBUG("Evicting %d idle handles", n);
+    for (i = 0; i < n; i++)
+        curl_easy_cleanup(io->handles[i].ch);
+    io->hnum -= n;
+    memmove(io->handles, io->handles + n, sizeof(etcd_io_handle) * io->hnum);
+}
+
+static int etcd_io_endpoint_grow(etcd_io *io, int num)
+{
+    etcd_io_endpoint *endpoints;
+
+    if (num <= io->epnum) return HIETCD_OK;
+    
+    endpoints = realloc(io->endpoints, sizeof(etcd_io_endpoint) * num);
+    if (endpoints == NULL) return HIETCD_ERR;
+    memset(endpoints + io->epnum, 0, sizeof(etcd_io_endpoint) * (num - io->epnum));
+    io->endpoints = endpoints;
+    io->epnum = num;
+    return HIETCD_OK;
+}
+
+/* Picks a server the request has not tried yet. Quarantined servers are
+ * skipped unless every candidate is, then the first to be released wins. */
+static int etcd_io_endpoint_pick(etcd_io *io, etcd_request *req)
+{
+    etcd_client *client = io->client;
+    etcd_io_endpoint *ep;
+    long long now = sev_time_ms();
+    int i, idx, n = client->snum, best = -1, qbest = -1;
+
+    if (n <= 0 || etcd_io_endpoint_grow(io, n) != HIETCD_OK)
+        return -1;
+
+    /* Writes skip the follower redirect when the leader is known */
+    if (io->leader >= 0 && io->leader < n && !(req->tried & (1 << io->leader))
+            && strcmp(req->method, ETCD_REQUEST_GET) != 0 
+            && io->endpoints[io->leader].qtime <= now)
+        return io->leader;
+
+    for (i = 0; i < n; i++) {
+        idx = (io->rrnext + i) % n;
+        if (req->tried & (1 << idx)) continue;
+
+        ep = &io->endpoints[idx];
+        if (ep->qtime > now) {
+            if (qbest < 0 || ep->qtime < io->endpoints[qbest].qtime)
+                qbest = idx;
+        } else if (best < 0) {
+            best = idx;
+            if (client->policy != HIETCD_POLICY_LEASTREQ) break;
+        } else if (ep->inflight < io->endpoints[best].inflight) {
+            best = idx;
+        }
+    }
+
+    if (best < 0) best = qbest;
+    if (best >= 0) io->rrnext = (best + 1) % n;
+    return best;
+}
+
+/* Books the result against the server. When the server failed in a way
+ * that is safe to repeat, the request is sent to the next server and 1
+ * is returned. */
+static int etcd_io_failover(etcd_io *io, etcd_request *req, CURLcode code)
+{
+    int retry;
+
+    if (!etcd_io_book(io, req, code))
+        return 0;
+
+    /* Unless it never reached the server */
+    retry = code == CURLE_COULDNT_RESOLVE_HOST || code == CURLE_COULDNT_CONNECT ||
+        strcmp(req->method, ETCD_REQUEST_GET) == 0 || 
+        (req->flags & ETCD_REQUEST_FLAG_IDEMPOTENT);
+    if (!retry || req->tried == (1 << io->client->snum) - 1)
+        return 0;
+
+    etcd_response_cleanup(req->resp);
+    if (etcd_io_dispatch(io, req) != HIETCD_OK) {
+        req->resp->ccode = code;
+        return 0;
+    }
+    return 1;
+}
+
+/* Releases the request's hold on its server and books the result: a
+ * transport failure quarantines the server, for longer each time in a
+ * row, anything else clears it. 1 if the server failed. */
+static int etcd_io_book(etcd_io *io, etcd_request *req, CURLcode code)
+{
+    etcd_io_endpoint *ep = &io->endpoints[req->ep];
+    int shift;
+
+    ep->inflight--;
+
+    switch (code) {
+    case CURLE_OPERATION_TIMEDOUT:
+        /* A quiet watch */
+        if (req->flags & ETCD_REQUEST_FLAG_WATCH) break;
+        /* fall through */
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_GOT_NOTHING:
+        ep->failures++;
+        shift = ep->failures < 5 ? ep->failures - 1 : 4;
+        ep->qtime = sev_time_ms() + ((long long)io->client->quarantine << shift);
+        ETCD_LOG_WARN("Server %s failed (%d), quarantined for %d ms", 
+                io->client->servers[req->ep], code, io->client->quarantine << shift);
+        if (req->ep == io->leader)
+            io->leader = -1;
+        return 1;
+    default:
+        break;
+    }
+
+    ep->failures = 0;
+    ep->qtime = 0;
+    return 0;
+}
+
+/* Index of the server url points at, or -1 */
+static int etcd_io_endpoint_find(etcd_io *io, const char *url)
+{
+    etcd_client *client = io->client;
+    size_t len;
+    int i;
+
+    for (i = 0; i < client->snum; i++) {
+        len = strlen(client->servers[i]);
+        if (strncmp(url, client->servers[i], len) == 0 && 
+                (url[len] == '/' || url[len] == '\0'))
+            return i;
+    }
+    return -1;
+}
+
+/* Asks the cluster for its leader, the reply goes to leader_update */
+static void etcd_io_leader_lookup(etcd_io *io)
+{
+    etcd_request *req;
+    char path[] = "/" HIETCD_SERVER_VERSION "/members/leader";
+
+    if (io->lookup || sev_time_ms() < io->ltime) return;
+
+    if ((req = etcd_request_create(path, sizeof(path) - 1, ETCD_REQUEST_GET)) == NULL)
+        return;
+    req->flags |= ETCD_REQUEST_FLAG_LEADER;
+
+    io->lookup = 1;
+    if (etcd_io_dispatch(io, req) != HIETCD_OK) {
+        io->lookup = 0;
+        etcd_request_destroy(req);
+    }
+}
+
+static void etcd_io_leader_set(etcd_io *io, int leader)
+{
+    if (leader < 0 || leader == io->leader) return;
+
+    ETCD_LOG_INFO("Leader is %s", io->client->servers[leader]);
+    io->leader = leader;
+    __sync_fetch_and_add(&io->client->stats.leader_changes, 1);
+}
+
+/* Learns the leader from lookups and redirected writes, and forgets it
+ * when the raft term moves on. ep is the server that answered. */
+static void etcd_io_leader_update(etcd_io *io, etcd_request *req, long redirects, int ep)
+{
+    etcd_response *resp = req->resp;
+    etcd_stats *stats = &io->client->stats;
+
+    if (req->flags & ETCD_REQUEST_FLAG_LEADER) 
+        io->lookup = 0;
+    if (resp->ccode != CURLE_OK) goto leader_update_done;
+
+    if (resp->rterm > io->rterm) {
+        if (io->rterm >= 0 && io->leader >= 0) {
+            ETCD_LOG_INFO("Raft term %lld, forgetting the leader", resp->rterm);
+            io->leader = -1;
+        }
+        io->rterm = resp->rterm;
+    }
+
+    if (req->flags & ETCD_REQUEST_FLAG_LEADER) {
+        if (resp->hcode == 200 && resp->clienturl)
+            etcd_io_leader_set(io, etcd_io_endpoint_find(io, resp->clienturl));
+    } else if (strcmp(req->method, ETCD_REQUEST_GET) != 0) {
+        if (redirects > 0) {
+            __sync_fetch_and_add(&stats->redirects, 1);
+            etcd_io_leader_set(io, ep);
+        } else if (req->ep == io->leader) {
+            __sync_fetch_and_add(&stats->redirects_avoided, 1);
+        }
+    }
+
+leader_update_done:
+    if ((req->flags & ETCD_REQUEST_FLAG_LEADER) && io->leader < 0)
+        io->ltime = sev_time_ms() + ETCD_IO_LEADER_RETRY;
+}
+
+static int etcd_io_dispatch(etcd_io *io, etcd_request *req)
+{
+    CURL *ch;
+    CURLMcode code;
+    char url[HIETCD_URL_BUFSIZE];
+    int ep;
+
+    if (io->leader < 0 && strcmp(req->method, ETCD_REQUEST_GET) != 0)
+        etcd_io_leader_lookup(io);
+
+    if ((ep = etcd_io_endpoint_pick(io, req)) < 0) {
+        ETCD_LOG_ERROR("No server to send %s to", req->path);
+        return HIETCD_ERR;
+    }
+    snprintf(url, sizeof(url), "%s%s", io->client->servers[ep], req->path);
+
+    if (req->resp == NULL && (req->resp = etcd_response_create()) == NULL) {
+        ETCD_LOG_ERROR("Failed to create response");
+        return HIETCD_ERR;
+    }
+
+    ch = etcd_io_handle_get(io);
+    if (!ch) {
+        ETCD_LOG_ERROR("Failed to init curl handler");
+        return HIETCD_ERR;
+    }
+
+    curl_easy_setopt(ch, CURLOPT_TIMEOUT, (long)io->client->timeout);
+    curl_easy_setopt(ch, CURLOPT_CONNECTTIMEOUT, (long)io->client->conntimeout);
+    curl_easy_setopt(ch, CURLOPT_URL, url);
+    curl_easy_setopt(ch, CURLOPT_CUSTOMREQUEST, req->method);
+    curl_easy_setopt(ch, CURLOPT_HEADERDATA, req->resp);
+    curl_easy_setopt(ch, CURLOPT_WRITEDATA, req->resp);
+    curl_easy_setopt(ch, CURLOPT_ERRORBUFFER, req->resp->errmsg);
+    curl_easy_setopt(ch, CURLOPT_PRIVATE, req);
 
     if (req->data) {
         curl_easy_setopt(ch, CURLOPT_POST, 1L);
-        curl_easy_setopt(ch, CURLOPT_POSTFIELDS, req->data);
+        curl_easy_setopt(ch, CURLOPT_COPYPOSTFIELDS, req->data);
+    } else {
+        curl_easy_setopt(ch, CURLOPT_HTTPGET, 1L);
     }
 
     code = curl_multi_add_handle(io->cmh, ch);
     if (code != CURLM_OK) {
         ETCD_LOG_ERROR("Failed to dispatch request: %d", code);
-        goto io_dispatch_err;
+        etcd_io_handle_put(io, ch);
+        return HIETCD_ERR;
     }
 
-    ETCD_LOG_DEBUG("curl_multi_add_handle: ok");
-    return;
+    /* First dispatch, failovers keep the list entry and the slot */
+    if (req->tried == 0) {
+        etcd_rq_insert(&io->inflight, &req->rq);
+        etcd_io_dequeue(io, req);
+        if (etcd_io_limit(io) > 0 && 
+                !(req->flags & (ETCD_REQUEST_FLAG_WATCH|ETCD_REQUEST_FLAG_LEADER))) {
+            req->flags |= ETCD_REQUEST_FLAG_SLOT;
+            io->active++;
+        }
+        /* Gets slower than most from this server go to a second one too */
+        if (io->client->hedge > 0 && io->client->snum > 1 && 
+                strcmp(req->method, ETCD_REQUEST_GET) == 0 && 
+                !(req->flags & (ETCD_REQUEST_FLAG_WATCH|ETCD_REQUEST_FLAG_LEADER))) {
+            long long delay = etcd_io_percentile(io, ep, io->client->hedge);
+            if (delay >= 0)
+                req->htid = sev_add_timer(io->pool, delay, etcd_io_hedge_cb, req);
+        }
+    }
 
-io_dispatch_err:
-    etcd_response_destroy(resp);
+    req->ch = ch;
+    req->ep = ep;
+    req->tried |= 1 << ep;
+    req->stime = sev_time_us();
+    io->endpoints[ep].inflight++;
+    ETCD_LOG_DEBUG("curl_multi_add_handle: ok");
+    return HIETCD_OK;
 }
 
 static int etcd_io_sock_cb(CURL *ch, curl_socket_t fd, int action, 
@@ -184,7 +1091,8 @@ static int etcd_io_sock_cb(CURL *ch, curl_socket_t fd, int action,
     ETCD_LOG_DEBUG("fd=%d, ch=%p, action=%s", fd, ch, actstr[action]);
 
     if (action == CURL_POLL_REMOVE) {
-        sev_del_event(io->pool, fd, flgs);
+        /* The fd number is likely reused by the next connection */
+        sev_del_event(io->pool, fd, SEV_R|SEV_W);
         if (sock) free(sock); 
     } else if (!sock) {
         ETCD_LOG_DEBUG("Adding data %s", actstr[action]); 
@@ -209,12 +1117,12 @@ static int etcd_io_multi_timer_cb(CURLM *cmh, long timeout_ms, etcd_io *io)
     HIETCD_UNUSED(cmh);
 
     ETCD_LOG_DEBUG("multi_timer_cb: Setting timeout to %ld ms\n", timeout_ms);
-    sev_del_timer(io->pool, io->tid);
-    if (timeout_ms > 0) {
+    if (timeout_ms < 0) {
+        sev_del_timer(io->pool, io->tid);
+        io->tid = -1;
+    } else if (sev_mod_timer(io->pool, io->tid, timeout_ms) != SEV_OK) {
+        /* Also covers 0, libcurl must not be reentered from here */
         io->tid = sev_add_timer(io->pool, timeout_ms, etcd_io_timer_cb, (void *)io); 
-        sev_add_timer(io->pool, timeout_ms, etcd_io_timer_cb, (void *)io); 
-    } else {
-        etcd_io_timer_cb(io->pool, -1, io); 
     }
     return 0;
 }
@@ -225,8 +1133,9 @@ static void etcd_io_timer_cb(struct sev_pool *pool, long long id, void *data)
     etcd_io *io = (etcd_io *) data; 
 
     HIETCD_UNUSED(pool);
+    HIETCD_UNUSED(id);
 
-    sev_del_timer(pool, id);
+    io->tid = -1;
     code = curl_multi_socket_action(io->cmh, CURL_SOCKET_TIMEOUT, 0, &io->running);
     if (code != CURLM_OK) {
         ETCD_LOG_ERROR("curl_multi_socket_action: %d", code);
@@ -248,19 +1157,19 @@ static void etcd_io_event_cb(sev_pool *pool, int fd, void *data, int flgs)
         ETCD_LOG_ERROR("curl_multi_socket_action: %d", code);
         return;
     }
+    /* The timer is left to libcurl: check_info may have just added a
+     * transfer for a failover, running is stale by then */
     etcd_io_check_info(io);
-    if (io->running <= 0) {
-        ETCD_LOG_DEBUG("last transfer done, kill timeout\n");
-        sev_del_timer(io->pool, io->tid);
-    }
 }
 
-static void etcd_io_response_cb(etcd_io *io, etcd_response *resp)
+static void etcd_io_response_cb(etcd_io *io, etcd_request *req)
 {
     etcd_client *client = io->client;
 
-    if (client->proc != NULL) {
-        client->proc(client, resp, client->userdata); 
+    if (req->proc != NULL) {
+        req->proc(client, req->resp, req->userdata); 
+    } else if (client->proc != NULL) {
+        client->proc(client, req->resp, client->userdata); 
     }
 }
 
@@ -271,38 +1180,188 @@ static void etcd_io_check_info(etcd_io *io)
     int msgs_left;
     CURL *ch;
     CURLcode code;
-    etcd_response *resp = NULL;
+    etcd_request *req = NULL;
+    etcd_response *resp;
+    long redirects;
+    int ep;
     
     while ((msg = curl_multi_info_read(io->cmh, &msgs_left))) {
         if (msg->msg == CURLMSG_DONE) {
             ch = msg->easy_handle;
             code = msg->data.result;
-            curl_easy_getinfo(ch, CURLINFO_PRIVATE, (void *)resp);
+            curl_easy_getinfo(ch, CURLINFO_PRIVATE, (char **)&req);
             curl_easy_getinfo(ch, CURLINFO_EFFECTIVE_URL, &eff_url);
+            resp = req->resp;
             ETCD_LOG_INFO("done, %s => (%d) %s", eff_url, code, resp->errmsg); 
             ETCD_LOG_DEBUG("remainning running %d", io->running);
+            redirects = 0;
+            ep = req->ep;
             if ((resp->ccode = code) == CURLE_OK) {
                 curl_easy_getinfo(ch, CURLINFO_RESPONSE_CODE, &resp->hcode);
-                etcd_response_parse(resp); 
-            } else {
-                resp->errcode = ETCD_ERR_CURL;
+                curl_easy_getinfo(ch, CURLINFO_REDIRECT_COUNT, &redirects);
+                if (redirects > 0) 
+                    ep = etcd_io_endpoint_find(io, eff_url);
             }
             curl_multi_remove_handle(io->cmh, ch);
-            curl_easy_cleanup(ch);
-            etcd_io_response_cb(io, resp);                 
-            etcd_response_destroy(resp);
+            etcd_io_handle_put(io, ch);
+            req->ch = NULL;
+
+            if (req->hedge != NULL) {
+                if ((req = etcd_io_hedge_settle(io, req, code)) == NULL)
+                    continue;
+                resp = req->resp;
+            }
+            if (code == CURLE_OK && strcmp(req->method, ETCD_REQUEST_GET) == 0 && 
+                    !(req->flags & (ETCD_REQUEST_FLAG_WATCH|ETCD_REQUEST_FLAG_LEADER)))
+                etcd_io_latency(io, req->ep, sev_time_us() - req->stime);
+
+            if (etcd_io_failover(io, req, code))
+                continue;
+
+            if (resp->ccode == CURLE_OK)
+                etcd_response_parse(resp); 
+            else
+                resp->errcode = ETCD_ERR_CURL;
+            etcd_io_leader_update(io, req, redirects, ep);
+            if (req->flags & ETCD_REQUEST_FLAG_SLOT)
+                etcd_io_adapt(io, req, resp->ccode != CURLE_OK || resp->hcode >= 500);
+            if (etcd_io_retry(io, req))
+                continue;
+            if ((req->flags & ETCD_REQUEST_FLAG_CACHE) && resp->hcode == 200 && 
+                    resp->errcode == ETCD_OK)
+                etcd_cache_store(io->client->cache, 
+                        req->path + sizeof("/" HIETCD_SERVER_VERSION "/keys") - 1, resp);
+            etcd_io_complete(io, req);
         }
     }
 }
 
+/* Hands the response over and releases a dispatched request, its
+ * slot goes to the oldest waiting request */
+static void etcd_io_complete(etcd_io *io, etcd_request *req)
+{
+    etcd_rq_remove(&req->rq);
+    etcd_io_unshare(io, req);
+    if (req->tid >= 0)
+        sev_del_timer(io->pool, req->tid);
+    if (req->htid >= 0)
+        sev_del_timer(io->pool, req->htid);
+    if (req->hedge)
+        etcd_io_hedge_drop(io, req->hedge);
+    if (req->flags & ETCD_REQUEST_FLAG_SLOT)
+        io->active--;
+    if (!(req->flags & ETCD_REQUEST_FLAG_LEADER))
+        etcd_io_response_cb(io, req);
+    etcd_io_fanout(io, req);
+    etcd_request_destroy(req);
+    etcd_io_drain(io);
+}
+
+/* Fails a request that never got dispatched */
+static void etcd_io_reject(etcd_io *io, etcd_request *req, int errcode, const char *errmsg)
+{
+    etcd_io_dequeue(io, req);
+    etcd_io_unshare(io, req);
+    if (req->tid >= 0)
+        sev_del_timer(io->pool, req->tid);
+    if (req->rtid >= 0)
+        sev_del_timer(io->pool, req->rtid);
+    if (req->resp == NULL) req->resp = etcd_response_create();
+    if (req->resp != NULL) {
+        req->resp->errcode = errcode;
+        snprintf(req->resp->errmsg, sizeof(req->resp->errmsg), "%s", errmsg);
+        etcd_io_response_cb(io, req);
+    }
+    etcd_io_fanout(io, req);
+    etcd_request_destroy(req);
+}
+
+/* Ends a request that is in flight, waiting for a slot or waiting on
+ * an identical get */
+static void etcd_io_abort(etcd_io *io, etcd_request *req, int errcode, const char *errmsg)
+{
+    etcd_response *resp = req->resp;
+
+    ETCD_LOG_INFO("Aborting request %lld: %s", req->id, errmsg);
+    etcd_io_handoff(io, req);
+    if (req->ep < 0) {
+        /* Not on its way, in the backlog, a waiters list or delayed */
+        etcd_rq_remove(&req->rq);
+        etcd_io_reject(io, req, errcode, errmsg);
+        return;
+    }
+    if (req->ch) {
+        curl_multi_remove_handle(io->cmh, req->ch);
+        etcd_io_handle_put(io, req->ch);
+        req->ch = NULL;
+        io->endpoints[req->ep].inflight--;
+    }
+    if (req->flags & ETCD_REQUEST_FLAG_LEADER)
+        io->lookup = 0;
+
+    etcd_response_cleanup(resp);
+    resp->errcode = errcode;
+    snprintf(resp->errmsg, sizeof(resp->errmsg), "%s", errmsg);
+    etcd_io_complete(io, req);
+}
+
+static void etcd_io_deadline_cb(sev_pool *pool, long long id, void *data)
+{
+    etcd_request *req = data;
+
+    HIETCD_UNUSED(id);
+
+    req->tid = -1;
+    if (req->flags & ETCD_REQUEST_FLAG_SLOT)
+        etcd_io_adapt(pool->data, req, 1);
+    etcd_io_abort(pool->data, req, ETCD_ERR_TIMEOUT, "deadline exceeded");
+}
+
+static void etcd_io_control(etcd_io *io, etcd_request *ctl)
+{
+    etcd_request *req;
+    long long ms;
+
+    if ((req = etcd_io_find(&io->inflight, ctl->target)) == NULL)
+        req = etcd_io_find(&io->backlog, ctl->target);
+    if (req == NULL)
+        req = etcd_io_find(&io->delayed, ctl->target);
+    /* Already done */
+    if (req == NULL) return;
+
+    if (ctl->flags & ETCD_REQUEST_FLAG_RETRIES) {
+        req->retries = ctl->deadline;
+        return;
+    }
+
+    if (ctl->flags & ETCD_REQUEST_FLAG_CANCEL) {
+        etcd_io_abort(io, req, ETCD_ERR_CANCELED, "canceled");
+        return;
+    }
+
+    if (req->tid >= 0) {
+        sev_del_timer(io->pool, req->tid);
+        req->tid = -1;
+    }
+    req->deadline = ctl->deadline;
+    if (req->deadline > 0) {
+        ms = req->ctime + req->deadline - sev_time_ms();
+        req->tid = sev_add_timer(io->pool, ms > 0 ? ms : 0, etcd_io_deadline_cb, req);
+    }
+}
+
 void *etcd_io_start(void *args)
 {
     etcd_io *io = (etcd_io *) args;
-    io->pool = sev_pool_create(io->size);
+    io->pool = sev_pool_create(io->size, io->client->timers == HIETCD_TIMERS_WHEEL ? 
+            SEV_TIMER_WHEEL : SEV_TIMER_HEAP);
     sev_add_event(io->pool, io->rfd, SEV_R, etcd_io_read, args);
     sev_set_cron(io->pool, etcd_io_cron);
+    io->pool->data = io;
 
     io->cmh = curl_multi_init();
+    if (io->client->reuse)
+        curl_multi_setopt(io->cmh, CURLMOPT_MAXCONNECTS, (long)io->client->poolsize);
     curl_multi_setopt(io->cmh, CURLMOPT_SOCKETFUNCTION, etcd_io_sock_cb);
     curl_multi_setopt(io->cmh, CURLMOPT_SOCKETDATA, io);
     curl_multi_setopt(io->cmh, CURLMOPT_TIMERFUNCTION, etcd_io_multi_timer_cb);
@@ -326,20 +1385,12 @@ void etcd_io_stop(etcd_io *io)
 
 void etcd_io_push_request(etcd_io *io, etcd_request *req)
 {
-    pthread_mutex_lock(&io->rqlock);
-    etcd_rq_insert(&io->rq, &req->rq);
-    pthread_mutex_unlock(&io->rqlock);
+    etcd_mpsc_push(&io->rq, &req->rq);
 }
 
+/* Consumer side, only called from the io thread */
 etcd_request *etcd_io_pop_request(etcd_io *io)
 {
-    etcd_request *req = NULL;
-    pthread_mutex_lock(&io->rqlock);
-    if (!etcd_rq_empty(&io->rq)) {
-        etcd_rq *rq = etcd_rq_last(&io->rq); 
-        req = etcd_rq_getreq(rq);
-        etcd_rq_remove(rq); 
-    }
-    pthread_mutex_unlock(&io->rqlock);
-    return req;
+    etcd_rq *rq = etcd_mpsc_pop(&io->rq);
+    return rq ? etcd_rq_getreq(rq) : NULL;
 }
@@ -31,6 +31,7 @@
 #ifndef _HIETCD_IO_H_
 #define _HIETCD_IO_H_
 
+#include <time.h>
 #include <pthread.h>
 
 #include <curl/curl.h>
@@ -39,12 +40,35 @@
 #include "request.h"
 #include "hietcd.h"
 
+#define ETCD_IO_LEADER_RETRY 1000 /* ms between failed leader lookups */
+#define ETCD_IO_AIMD_TOLERANCE 2 /* latency over this many times the baseline is overload */
+#define ETCD_IO_AIMD_BASELINE 10000 /* ms before the latency baseline is learned again */
+#define ETCD_IO_HIST_SIZE 128 /* latency buckets, four per power of two us */
+#define ETCD_IO_HIST_WINDOW 1024 /* samples kept before older ones are halved */
+#define ETCD_IO_HEDGE_SAMPLES 32 /* samples a server needs before its gets are hedged */
+
 typedef struct etcd_io etcd_io;
 
+/* Idle curl easy handle */
+typedef struct etcd_io_handle {
+    CURL *ch;
+    time_t atime; /* time the handle was released */
+} etcd_io_handle;
+
+/* Per server state, owned by the io thread */
+typedef struct etcd_io_endpoint {
+    int inflight; /* requests outstanding */
+    int failures; /* consecutive failures */
+    long long qtime; /* quarantined until, in sev_time_ms */
+    unsigned int samples; /* get latencies in hist */
+    unsigned int hist[ETCD_IO_HIST_SIZE];
+} etcd_io_endpoint;
+
 /* Etcd http io structure */
 struct etcd_io {
     int ready;
-    int rfd; /* Readable pipe fd */
+    int rfd; /* Readable notify fd */
+    int notified; /* Wakeup pending on rfd */
     int size; /* Event pool size */
     int running; /* Still running */
     long long tid; /* Timer id */
@@ -52,9 +76,37 @@ struct etcd_io {
     sev_pool *pool; /* Event pool */
     struct etcd_client *client; /* Global config */
     CURLM *cmh; /* CURL multi handler */
-    /* Request queue */
-    etcd_rq rq;
-    pthread_mutex_t rqlock;
+    /* Idle easy handles, the most recently used on top */
+    int hnum;
+    int hmaxnum;
+    etcd_io_handle *handles;
+    /* Servers, indexed like client->servers */
+    int epnum;
+    int rrnext; /* round robin position */
+    etcd_io_endpoint *endpoints;
+    /* Leader, writes are sent straight to it */
+    int leader; /* server index, -1 if unknown */
+    int lookup; /* leader lookup in flight */
+    long long ltime; /* no lookup before, in sev_time_ms */
+    long long rterm; /* highest raft term seen */
+    etcd_mpsc rq; /* Request queue */
+    etcd_rq inflight; /* Dispatched requests */
+    struct etcd_dict *gets; /* path => get others may wait on */
+    struct etcd_batch *batches; /* started and not yet done */
+    /* Admission, see etcd_client.maxinflight and maxqueue */
+    etcd_rq backlog; /* waiting for a slot, oldest first */
+    etcd_rq delayed; /* waiting to be retried */
+    unsigned int seed; /* retry jitter */
+    int limit; /* in-flight slots, 0 for no limit */
+    int active; /* slots taken */
+    int grow; /* completions at the limit since it last grew */
+    long long rttmin; /* latency baseline, in us */
+    long long rttbase; /* baseline learned at, in sev_time_ms */
+    long long cutoff; /* limit not cut again before, in sev_time_ms */
+    int queued; /* submitted and not yet sent, shared with producers */
+    int qwaiters; /* producers blocked on qcond */
+    pthread_cond_t qcond;
+    pthread_mutex_t qlock;
     /* cond&lock */
     pthread_cond_t cond;
     pthread_mutex_t lock;
@@ -73,5 +125,7 @@ void *etcd_io_start(void *args);
 void etcd_io_stop(etcd_io *io);
 void etcd_io_push_request(etcd_io *io, etcd_request *req);
 etcd_request *etcd_io_pop_request(etcd_io *io);
+void etcd_io_submit(etcd_io *io, etcd_request *req);
+int etcd_io_admit(etcd_io *io);
 
 #endif
@@ -0,0 +1,411 @@
+/*
+ * Copyright (c) 2014-2015, Qingbin Piao <piaoqingbin at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lease.h"
+#include "log.h"
+
+static etcd_lease *etcd_lease_create(etcd_client *client, const char *key, const char *value, 
+        int ttl, int flags, etcd_lease_proc *proc, void *userdata);
+static int etcd_lease_write(etcd_lease *lease);
+static long long etcd_lease_interval(etcd_lease *lease);
+static void etcd_lease_heartbeat(etcd_lease *lease);
+static etcd_lease *etcd_lease_retain(etcd_lease *lease);
+static void etcd_lease_put(etcd_lease *lease);
+static int etcd_lease_delete(etcd_lease *lease);
+static void etcd_lease_acquire_cb(etcd_client *client, etcd_response *resp, void *userdata);
+static void etcd_lease_refresh_cb(etcd_client *client, etcd_response *resp, void *userdata);
+static void etcd_lease_delete_cb(etcd_client *client, etcd_response *resp, void *userdata);
+static etcd_lease_sched *etcd_lease_get_sched(etcd_client *client);
+static void etcd_lease_schedule(etcd_lease *lease, long long due);
+static void etcd_lease_unschedule(etcd_lease *lease);
+static void etcd_lease_arm(etcd_client *client);
+static void etcd_lease_tick(sev_pool *pool, long long id, void *data);
+
+/* Creates key with value and ttl seconds unless it exists, the outcome
+ * goes to proc on the io thread */
+etcd_lease *etcd_lease_acquire(etcd_client *client, const char *key, const char *value, 
+    int ttl, etcd_lease_proc *proc, void *userdata)
+{
+    return etcd_lease_create(client, key, value, ttl, 0, proc, userdata);
+}
+
+/* Stops refreshing and deletes the key if it is still ours. Events may
+ * still arrive until HIETCD_LEASE_RELEASED. */
+void etcd_lease_release(etcd_lease *lease)
+{
+    __sync_fetch_and_or(&lease->releasing, 1);
+    /* A write completing now sees releasing and deletes the key itself */
+    if (__sync_fetch_and_add(&lease->state, 0) == ETCD_LEASE_HELD)
+        etcd_lease_delete(lease);
+    etcd_lease_put(lease);
+}
+
+/* Keeps dir/name set to value for as long as the process runs. The key
+ * is written again whenever it goes missing, and heartbeats land at a
+ * random point of the second half of each ttl/3, so a fleet started
+ * together does not keep writing together. */
+etcd_lease *etcd_register(etcd_client *client, const char *dir, const char *name, 
+    const char *value, int ttl, etcd_lease_proc *proc, void *userdata)
+{
+    char key[HIETCD_URL_BUFSIZE];
+
+    snprintf(key, sizeof(key), "%s/%s", dir, name);
+    return etcd_lease_create(client, key, value, ttl, ETCD_LEASE_FLAG_REGISTER, 
+            proc, userdata);
+}
+
+void etcd_unregister(etcd_lease *lease)
+{
+    etcd_lease_release(lease);
+}
+
+void etcd_lease_sched_destroy(etcd_lease_sched *sched)
+{
+    free(sched);
+}
+
+static etcd_lease *etcd_lease_create(etcd_client *client, const char *key, const char *value, 
+    int ttl, int flags, etcd_lease_proc *proc, void *userdata)
+{
+    etcd_lease *lease;
+
+    if (ttl <= 0) return NULL;
+    if ((lease = calloc(1, sizeof(etcd_lease))) == NULL)
+        return NULL;
+    if ((lease->key = strdup(key)) == NULL || (lease->value = strdup(value)) == NULL)
+        goto create_err;
+
+    lease->client = client;
+    lease->ttl = ttl;
+    lease->flags = flags;
+    lease->refcount = 2; /* the caller and the write */
+    lease->state = ETCD_LEASE_PENDING;
+    lease->proc = proc;
+    lease->userdata = userdata;
+
+    if (etcd_lease_write(lease) != HIETCD_OK)
+        goto create_err;
+    return lease;
+
+create_err:
+    if (lease->key) free(lease->key);
+    if (lease->value) free(lease->value);
+    free(lease);
+    return NULL;
+}
+
+/* The write that takes the key, its reference comes from the caller */
+static int etcd_lease_write(etcd_lease *lease)
+{
+    etcd_client *client = lease->client;
+    long long id;
+
+    lease->sent = sev_time_us();
+    if (lease->flags & ETCD_LEASE_FLAG_REGISTER) {
+        id = etcd_aset(client, lease->key, lease->value, strlen(lease->value), 
+                lease->ttl, etcd_lease_acquire_cb, lease);
+    } else {
+        id = etcd_acreate(client, lease->key, lease->value, strlen(lease->value), 
+                lease->ttl, etcd_lease_acquire_cb, lease);
+    }
+    return id == HIETCD_ERR ? HIETCD_ERR : HIETCD_OK;
+}
+
+/* A third of the ttl, registrations pick a point in its second half */
+static long long etcd_lease_interval(etcd_lease *lease)
+{
+    etcd_lease_sched *sched = etcd_lease_get_sched(lease->client);
+    long long interval = lease->ttl * 1000LL / 3;
+
+    if ((lease->flags & ETCD_LEASE_FLAG_REGISTER) && sched != NULL)
+        interval -= rand_r(&sched->seed) % (interval / 2 + 1);
+    return interval;
+}
+
+static void etcd_lease_heartbeat(etcd_lease *lease)
+{
+    etcd_stats *stats = &lease->client->stats;
+    long long us = sev_time_us() - lease->sent;
+
+    __sync_fetch_and_add(&stats->heartbeats, 1);
+    __sync_fetch_and_add(&stats->heartbeat_us, us);
+    /* Only the io thread writes it */
+    if (us > stats->heartbeat_max_us)
+        __sync_lock_test_and_set(&stats->heartbeat_max_us, us);
+}
+
+static etcd_lease *etcd_lease_retain(etcd_lease *lease)
+{
+    __sync_add_and_fetch(&lease->refcount, 1);
+    return lease;
+}
+
+static void etcd_lease_put(etcd_lease *lease)
+{
+    if (__sync_sub_and_fetch(&lease->refcount, 1) > 0)
+        return;
+
+    if (lease->proc)
+        lease->proc(lease, HIETCD_LEASE_RELEASED, NULL, lease->userdata);
+    free(lease->key);
+    free(lease->value);
+    free(lease);
+}
+
+/* Deletes the key only while it still holds our value */
+static int etcd_lease_delete(etcd_lease *lease)
+{
+    etcd_cond cond = {lease->value, 0, HIETCD_PREV_ANY};
+
+    if (etcd_acad(lease->client, lease->key, &cond, etcd_lease_delete_cb, 
+                etcd_lease_retain(lease)) == HIETCD_ERR) {
+        etcd_lease_put(lease);
+        return HIETCD_ERR;
+    }
+    return HIETCD_OK;
+}
+
+/* The write's reference moves on to the schedule while the lease lives */
+static void etcd_lease_acquire_cb(etcd_client *client, etcd_response *resp, void *userdata)
+{
+    etcd_lease *lease = userdata;
+    long long now = sev_time_ms();
+    int event;
+
+    HIETCD_UNUSED(client);
+
+    if (resp->errcode == ETCD_OK && (resp->hcode == 200 || resp->hcode == 201)) {
+        etcd_lease_heartbeat(lease);
+        lease->expires = now + lease->ttl * 1000LL;
+        __sync_lock_test_and_set(&lease->state, ETCD_LEASE_HELD);
+        __sync_synchronize();
+        if (lease->releasing) {
+            etcd_lease_delete(lease);
+            goto acquire_cb_put;
+        }
+        etcd_lease_schedule(lease, now + etcd_lease_interval(lease));
+        event = HIETCD_LEASE_ACQUIRED;
+    } else if (lease->flags & ETCD_LEASE_FLAG_REGISTER) {
+        if (lease->releasing) goto acquire_cb_put;
+        /* Registrations keep trying */
+        etcd_lease_schedule(lease, now + ETCD_LEASE_RETRY);
+        event = HIETCD_LEASE_FAILED;
+    } else {
+        lease->state = ETCD_LEASE_DEAD;
+        if (lease->releasing) goto acquire_cb_put;
+        event = resp->errcode == ETCD_ERRCODE_NODE_EXIST ? 
+            HIETCD_LEASE_BUSY : HIETCD_LEASE_FAILED;
+        if (lease->proc)
+            lease->proc(lease, event, resp, lease->userdata);
+        goto acquire_cb_put;
+    }
+    if (lease->proc)
+        lease->proc(lease, event, resp, lease->userdata);
+    return;
+
+acquire_cb_put:
+    etcd_lease_put(lease);
+}
+
+/* The schedule's reference rode along with the refresh */
+static void etcd_lease_refresh_cb(etcd_client *client, etcd_response *resp, void *userdata)
+{
+    etcd_lease *lease = userdata;
+    long long now = sev_time_ms(), due;
+
+    HIETCD_UNUSED(client);
+
+    if (lease->releasing) goto refresh_cb_put;
+
+    if (resp->errcode == ETCD_OK && resp->hcode == 200) {
+        etcd_lease_heartbeat(lease);
+        lease->expires = now + lease->ttl * 1000LL;
+        etcd_lease_schedule(lease, now + etcd_lease_interval(lease));
+        return;
+    }
+
+    if (resp->errcode != ETCD_ERRCODE_KEY_NOT_FOUND) {
+        /* Still ours until the ttl runs out */
+        due = now + ETCD_LEASE_RETRY;
+        if (due < lease->expires) {
+            ETCD_LOG_WARN("Refreshing %s failed, retrying", lease->key);
+            etcd_lease_schedule(lease, due);
+            return;
+        }
+    }
+
+    ETCD_LOG_WARN("Lease %s lost", lease->key);
+    if (lease->flags & ETCD_LEASE_FLAG_REGISTER) {
+        lease->state = ETCD_LEASE_PENDING;
+        if (lease->proc)
+            lease->proc(lease, HIETCD_LEASE_LOST, resp, lease->userdata);
+        if (lease->releasing) goto refresh_cb_put;
+        if (etcd_lease_write(lease) != HIETCD_OK)
+            etcd_lease_schedule(lease, now + ETCD_LEASE_RETRY);
+        return;
+    }
+    lease->state = ETCD_LEASE_DEAD;
+    if (lease->proc)
+        lease->proc(lease, HIETCD_LEASE_LOST, resp, lease->userdata);
+
+refresh_cb_put:
+    etcd_lease_put(lease);
+}
+
+static void etcd_lease_delete_cb(etcd_client *client, etcd_response *resp, void *userdata)
+{
+    etcd_lease *lease = userdata;
+
+    HIETCD_UNUSED(client);
+    HIETCD_UNUSED(resp);
+
+    lease->state = ETCD_LEASE_DEAD;
+    if (lease->scheduled) {
+        etcd_lease_unschedule(lease);
+        etcd_lease_put(lease);
+    }
+    etcd_lease_put(lease);
+}
+
+static etcd_lease_sched *etcd_lease_get_sched(etcd_client *client)
+{
+    /* Each client jitters from its own seed, rand_r is not shared */
+    if (client->leases == NULL && 
+            (client->leases = calloc(1, sizeof(etcd_lease_sched))) != NULL) {
+        client->leases->seed = (unsigned int)time(NULL) ^ (unsigned int)getpid() ^ 
+            (unsigned int)(uintptr_t)client;
+    }
+    return client->leases;
+}
+
+/* Keeps the schedule sorted by due. Refreshes mostly come due in the
+ * order they were scheduled, so the walk from the tail is short. */
+static void etcd_lease_schedule(etcd_lease *lease, long long due)
+{
+    etcd_lease_sched *sched = etcd_lease_get_sched(lease->client);
+    etcd_lease *prev;
+
+    if (sched == NULL) {
+        ETCD_LOG_ERROR("Out of memory, %s is not refreshed", lease->key);
+        lease->state = ETCD_LEASE_DEAD;
+        etcd_lease_put(lease);
+        return;
+    }
+
+    lease->due = due;
+    lease->scheduled = 1;
+    for (prev = sched->tail; prev != NULL && prev->due > due; prev = prev->prev);
+    lease->prev = prev;
+    lease->next = prev ? prev->next : sched->head;
+    if (lease->next) 
+        lease->next->prev = lease;
+    else
+        sched->tail = lease;
+    if (prev) 
+        prev->next = lease;
+    else
+        sched->head = lease;
+
+    etcd_lease_arm(lease->client);
+}
+
+static void etcd_lease_unschedule(etcd_lease *lease)
+{
+    etcd_lease_sched *sched = lease->client->leases;
+
+    if (lease->prev) 
+        lease->prev->next = lease->next;
+    else
+        sched->head = lease->next;
+    if (lease->next) 
+        lease->next->prev = lease->prev;
+    else
+        sched->tail = lease->prev;
+    lease->prev = lease->next = NULL;
+    lease->scheduled = 0;
+}
+
+/* One timer for the earliest refresh */
+static void etcd_lease_arm(etcd_client *client)
+{
+    etcd_lease_sched *sched = client->leases;
+    sev_pool *pool = client->io->pool;
+    long long now;
+
+    if (sched->head == NULL) return;
+    if (sched->tid && sched->when <= sched->head->due) return;
+
+    if (sched->tid) 
+        sev_del_timer(pool, sched->tid);
+    now = sev_time_ms();
+    sched->when = sched->head->due;
+    sched->tid = sev_add_timer(pool, sched->when > now ? sched->when - now : 0, 
+            etcd_lease_tick, client);
+}
+
+/* Refreshes everything due within ETCD_LEASE_COALESCE, a little early
+ * rather than a tick of its own each */
+static void etcd_lease_tick(sev_pool *pool, long long id, void *data)
+{
+    etcd_client *client = data;
+    etcd_lease_sched *sched = client->leases;
+    etcd_lease *lease;
+    long long now = sev_time_ms();
+
+    HIETCD_UNUSED(pool);
+    HIETCD_UNUSED(id);
+
+    sched->tid = 0;
+    while ((lease = sched->head) != NULL && lease->due <= now + ETCD_LEASE_COALESCE) {
+        etcd_lease_unschedule(lease);
+        if (lease->releasing) {
+            etcd_lease_put(lease);
+            continue;
+        }
+        /* Registrations that lost their key write it again */
+        if (lease->state == ETCD_LEASE_PENDING) {
+            if (etcd_lease_write(lease) != HIETCD_OK)
+                etcd_lease_schedule(lease, now + ETCD_LEASE_RETRY);
+            continue;
+        }
+        lease->sent = sev_time_us();
+        if (etcd_arefresh(client, lease->key, lease->ttl, 
+                    etcd_lease_refresh_cb, lease) == HIETCD_ERR)
+            etcd_lease_schedule(lease, now + ETCD_LEASE_RETRY);
+    }
+    etcd_lease_arm(client);
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2014-2015, Qingbin Piao <piaoqingbin at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _HIETCD_LEASE_H_
+#define _HIETCD_LEASE_H_
+
+#include "hietcd.h"
+
+#define ETCD_LEASE_COALESCE 500 /* ms, refreshes due this close share a tick */
+#define ETCD_LEASE_RETRY 1000 /* ms before a failed refresh is retried */
+
+/* Lease flags */
+#define ETCD_LEASE_FLAG_REGISTER 0x1 /* set rather than create, jittered, re-set when lost */
+
+/* Lease events */
+#define HIETCD_LEASE_ACQUIRED 0 /* key written, refreshes are scheduled */
+#define HIETCD_LEASE_BUSY 1 /* key held by someone else */
+#define HIETCD_LEASE_FAILED 2 /* acquiring failed, resp holds the error */
+#define HIETCD_LEASE_LOST 3 /* key gone, or not refreshed within its ttl.
+                               A registration is written again. */
+#define HIETCD_LEASE_RELEASED 4 /* last call, resp is NULL */
+
+/* Lease states */
+#define ETCD_LEASE_PENDING 0
+#define ETCD_LEASE_HELD 1
+#define ETCD_LEASE_DEAD 2
+
+typedef struct etcd_lease etcd_lease;
+typedef void etcd_lease_proc(etcd_lease *lease, int event, etcd_response *resp, void *userdata);
+
+/* Key held with a ttl. Refreshes run on the io thread at a third of
+ * the ttl, referenced by the caller, the schedule and every request. */
+struct etcd_lease {
+    etcd_client *client;
+    char *key;
+    char *value; /* identifies the holder, the release deletes on it */
+    int ttl;
+    int flags;
+    int refcount;
+    int state;
+    int releasing;
+    int scheduled; /* in the schedule, holding a reference */
+    long long due; /* next refresh, in sev_time_ms */
+    long long expires; /* held at least until, in sev_time_ms */
+    long long sent; /* last write sent, in sev_time_us */
+    etcd_lease_proc *proc;
+    void *userdata;
+    struct etcd_lease *prev; /* schedule, by due */
+    struct etcd_lease *next;
+};
+
+/* Leases to refresh, owned by the io thread */
+typedef struct etcd_lease_sched {
+    etcd_lease *head;
+    etcd_lease *tail;
+    long long tid; /* refresh timer, 0 when idle */
+    long long when; /* it fires at, in sev_time_ms */
+    unsigned int seed; /* registration jitter */
+} etcd_lease_sched;
+
+/* Release leases, and wait for HIETCD_LEASE_RELEASED, before
+ * destroying the client */
+etcd_lease *etcd_lease_acquire(etcd_client *client, const char *key, const char *value, 
+        int ttl, etcd_lease_proc *proc, void *userdata);
+void etcd_lease_release(etcd_lease *lease);
+etcd_lease *etcd_register(etcd_client *client, const char *dir, const char *name, 
+        const char *value, int ttl, etcd_lease_proc *proc, void *userdata);
+void etcd_unregister(etcd_lease *lease);
+void etcd_lease_sched_destroy(etcd_lease_sched *sched);
+
+#endif
@@ -32,25 +32,96 @@
 #include <string.h>
 
 #include "request.h"
+#include "response.h"
 
-etcd_request *etcd_request_create(char *url, size_t len, const char *method)
+etcd_request *etcd_request_create(char *path, size_t len, const char *method)
 {
     etcd_request *req;
 
     if (!(req = malloc(sizeof(etcd_request))))
         return NULL;
 
-    req->url = strndup(url, len);
+    req->id = 0;
+    req->path = path ? strndup(path, len) : NULL;
     req->method = method;
     req->data = NULL;
+    req->flags = 0;
+    req->deadline = 0;
+    req->ctime = 0;
+    req->stime = 0;
+    req->tid = -1;
+    req->htid = -1;
+    req->rtid = -1;
+    req->retries = 0;
+    req->attempts = 0;
+    req->target = 0;
+    req->ch = NULL;
+    req->ep = -1;
+    req->tried = 0;
+    req->resp = NULL;
+    req->proc = NULL;
+    req->userdata = NULL;
     etcd_rq_init(&req->rq);
+    etcd_rq_init(&req->waiters);
+    req->hedge = NULL;
 
     return req;
 }
 
 void etcd_request_destroy(etcd_request *req)
 {
-    if (req->url) free(req->url);
+    if (req->path) free(req->path);
     if (req->data) free(req->data);
+    if (req->resp) etcd_response_destroy(req->resp);
     free(req);
 }
+
+void etcd_mpsc_init(etcd_mpsc *q)
+{
+    q->stub.prev = NULL;
+    q->stub.next = NULL;
+    q->head = &q->stub;
+    q->tail = &q->stub;
+}
+
+void etcd_mpsc_push(etcd_mpsc *q, etcd_rq *n)
+{
+    etcd_rq *prev;
+
+    n->next = NULL;
+    prev = __atomic_exchange_n(&q->head, n, __ATOMIC_ACQ_REL);
+    /* Until this store the consumer sees the queue end at prev */
+    __atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+}
+
+/* Returns NULL when empty, or when a producer is halfway through a push;
+ * that producer notifies the consumer once it is done. */
+etcd_rq *etcd_mpsc_pop(etcd_mpsc *q)
+{
+    etcd_rq *tail = q->tail;
+    etcd_rq *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+    if (tail == &q->stub) {
+        if (next == NULL) return NULL;
+        q->tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+
+    if (tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    /* tail is the last node, put the stub behind it to unlink it */
+    etcd_mpsc_push(q, &q->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
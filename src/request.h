@@ -31,12 +31,29 @@
 #ifndef _HIETCD_REQUEST_H_
 #define _HIETCD_REQUEST_H_
 
+#include <stddef.h>
+
 /* Etcd request methods */
 #define ETCD_REQUEST_GET "GET"
-#define ETCD_REQUSET_POST "POST"
+#define ETCD_REQUEST_POST "POST"
+#define ETCD_REQUSET_POST ETCD_REQUEST_POST /* old misspelling */
 #define ETCD_REQUEST_PUT "PUT"
 #define ETCD_REQUEST_DELETE "DELETE"
 
+/* Etcd request flags */
+#define ETCD_REQUEST_FLAG_WATCH 0x1 /* long poll, timing out is not a failure */
+#define ETCD_REQUEST_FLAG_LEADER 0x2 /* internal leader lookup */
+#define ETCD_REQUEST_FLAG_CANCEL 0x4 /* control: cancel target */
+#define ETCD_REQUEST_FLAG_DEADLINE 0x8 /* control: set the deadline of target */
+#define ETCD_REQUEST_FLAG_CACHE 0x10 /* get whose reply goes to the client cache */
+#define ETCD_REQUEST_FLAG_BATCH 0x20 /* carries an etcd_batch in userdata */
+#define ETCD_REQUEST_FLAG_QUEUED 0x40 /* counted in io->queued until sent */
+#define ETCD_REQUEST_FLAG_SLOT 0x80 /* holds one of the io->limit slots */
+#define ETCD_REQUEST_FLAG_SHARED 0x100 /* get listed in io->gets, others may wait on it */
+#define ETCD_REQUEST_FLAG_HEDGE 0x200 /* duplicate of a slow get, sent to another server */
+#define ETCD_REQUEST_FLAG_IDEMPOTENT 0x400 /* write that may be repeated, gets always may */
+#define ETCD_REQUEST_FLAG_RETRIES 0x800 /* control: set the retries of target */
+
 /* Etcd request queue */
 typedef struct etcd_request_queue etcd_rq;
 
@@ -64,20 +81,54 @@ struct etcd_request_queue {
 #define etcd_rq_last(h)     ((h)->prev)
 #define etcd_rq_prev(q)     ((q)->prev)
 #define etcd_rq_next(q)     ((q)->next)
-#define etcd_rq_getreq(q)   ((etcd_request *)((size_t)(q)-(3*sizeof(void *))))
+#define etcd_rq_getreq(q)   ((etcd_request *)((char *)(q)-offsetof(etcd_request, rq)))
 
-/* Etcd request structure */
+/* Lock-free multi-producer/single-consumer request queue. Requests are
+ * linked through etcd_rq.next, so pushing never allocates or locks. */
 typedef struct {
-    char *url; /* http://host:port/path/to/key?foo=bar */
+    etcd_rq *head; /* most recently pushed, swapped by producers */
+    etcd_rq *tail; /* next to pop, owned by the consumer */
+    etcd_rq stub;
+} etcd_mpsc;
+
+struct etcd_client;
+struct etcd_response;
+
+/* Etcd request structure */
+typedef struct etcd_request {
+    long long id; /* handle returned to the caller */
+    char *path; /* /v2/keys/path/to/key?foo=bar, the server is picked by io */
     const char *method; /* http method */
     char *data;
+    int flags;
+    int deadline; /* ms after ctime the request fails, 0 for none */
+    long long ctime; /* submit time, in sev_time_ms */
+    long long stime; /* latest dispatch, in sev_time_us */
+    long long tid; /* deadline timer id */
+    long long htid; /* hedge timer id */
+    long long rtid; /* retry timer id */
+    int retries; /* attempts allowed after the first */
+    int attempts; /* attempts made after the first */
+    long long target; /* request a control request applies to */
+    void *ch; /* curl easy handle while in flight */
+    int ep; /* server the request is sent to, -1 before dispatch */
+    int tried; /* bitmask of servers already tried */
+    struct etcd_response *resp; /* response being received */
+    /* completion, an etcd_response_proc */
+    void (*proc)(struct etcd_client *client, struct etcd_response *resp, void *userdata);
+    void *userdata;
     etcd_rq rq; 
+    etcd_rq waiters; /* identical gets answered with this one's reply */
+    struct etcd_request *hedge; /* the duplicate of a get, or the get of a duplicate */
 } etcd_request;
 
 #define etcd_request_set_data(r,d)      ((r)->data = (d))
 #define etcd_request_dup_data(r,d,l)    ((r)->data = strndup((d),(l)))
 
-etcd_request *etcd_request_create(char *url, size_t len, const char *method);
+etcd_request *etcd_request_create(char *path, size_t len, const char *method);
 void etcd_request_destroy(etcd_request *req);
+void etcd_mpsc_init(etcd_mpsc *q);
+void etcd_mpsc_push(etcd_mpsc *q, etcd_rq *n);
+etcd_rq *etcd_mpsc_pop(etcd_mpsc *q);
 
 #endif
@@ -28,20 +28,17 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include <yajl/yajl_tree.h>
+#include <yajl/yajl_parse.h>
 
 #include "hietcd.h"
 #include "response.h"
 
-/* Parse flags */
-#define PF_NULL     0
-#define PF_LONG     1
-#define PF_STRCPY   2
-
 typedef enum {
+    ETCD_RESP_KEY_NONE = -1,
     ETCD_RESP_KEY_ERRCODE = 0,
     ETCD_RESP_KEY_MESSAGE,
     ETCD_RESP_KEY_ACTION,
@@ -54,51 +51,92 @@ typedef enum {
     ETCD_RESP_KEY_MIDX,
     ETCD_RESP_KEY_TTL,
     ETCD_RESP_KEY_EXPR,
-    ETCD_RESP_KEY_NODES
+    ETCD_RESP_KEY_NODES,
+    ETCD_RESP_KEY_CURLS
 } etcd_resp_key;
 
-static const char *etcd_resp_key_path[13][2] = {
-    {"errorCode", NULL},
-    {"message", NULL},
-    {"action", NULL},
-    {"node", NULL},
-    {"prevNode", NULL},
-    {"key", NULL},
-    {"dir", NULL},
-    {"value", NULL},
-    {"createdIndex", NULL},
-    {"modifiedIndex", NULL},
-    {"ttl", NULL},
-    {"expiration", NULL},
-    {"nodes", NULL}
+#define ETCD_RESP_KEY_NUM 14
+
+static const char *etcd_resp_key_name[ETCD_RESP_KEY_NUM] = {
+    "errorCode",
+    "message",
+    "action",
+    "node",
+    "prevNode",
+    "key",
+    "dir",
+    "value",
+    "createdIndex",
+    "modifiedIndex",
+    "ttl",
+    "expiration",
+    "nodes",
+    "clientURLs"
 };
 
-static yajl_type etcd_resp_key_type[] = {
-    yajl_t_number,
-    yajl_t_string,
-    yajl_t_string,
-    yajl_t_object,
-    yajl_t_object,
-    yajl_t_string,
-    yajl_t_true,
-    yajl_t_string,
-    yajl_t_number,
-    yajl_t_number,
-    yajl_t_number,
-    yajl_t_string,
-    yajl_t_array
-};
+/* Parser frame types */
+#define PF_ROOT     0 /* response object */
+#define PF_NODE     1 /* node object */
+#define PF_NODES    2 /* array of child nodes */
+#define PF_URLS     3 /* clientURLs of a member */
+
+#define ETCD_PARSER_DEPTH 8 /* initial frame stack size */
+
+/* Parser frame */
+typedef struct {
+    int type;
+    etcd_node *node; /* node being filled, or parent of the array */
+    etcd_node *last; /* last child appended */
+} etcd_parser_frame;
+
+/* Streaming parser state, fed from etcd_response_write_cb */
+typedef struct etcd_parser {
+    yajl_handle h;
+    etcd_response *resp;
+    yajl_status status;
+    etcd_resp_key key; /* key of the value coming next */
+    int skip; /* nesting inside an ignored value */
+    int depth;
+    int maxdepth;
+    etcd_parser_frame *frames;
+} etcd_parser;
 
 static inline void etcd_response_init(etcd_response *resp);
-static int etcd_response_parse_err(etcd_response *resp, yajl_val obj);
-static etcd_node *etcd_response_parse_node(yajl_val obj, int parse_child);
-static int etcd_response_parse_key(yajl_val obj, etcd_resp_key, void *data, int flgs);
+static void etcd_response_flatten(etcd_response *resp);
+static etcd_parser *etcd_parser_create(etcd_response *resp);
+static void etcd_parser_destroy(etcd_parser *p);
+static etcd_parser_frame *etcd_parser_push(etcd_parser *p, int type, etcd_node *node);
+static etcd_parser_frame *etcd_parser_value(etcd_parser *p);
+static int etcd_parse_null(void *ctx);
+static int etcd_parse_boolean(void *ctx, int val);
+static int etcd_parse_integer(void *ctx, long long val);
+static int etcd_parse_double(void *ctx, double val);
+static int etcd_parse_string(void *ctx, const unsigned char *val, size_t len);
+static int etcd_parse_start_map(void *ctx);
+static int etcd_parse_map_key(void *ctx, const unsigned char *key, size_t len);
+static int etcd_parse_end_map(void *ctx);
+static int etcd_parse_start_array(void *ctx);
+static int etcd_parse_end_array(void *ctx);
+
+static yajl_callbacks etcd_parse_callbacks = {
+    etcd_parse_null,
+    etcd_parse_boolean,
+    etcd_parse_integer,
+    etcd_parse_double,
+    NULL,
+    etcd_parse_string,
+    etcd_parse_start_map,
+    etcd_parse_map_key,
+    etcd_parse_end_map,
+    etcd_parse_start_array,
+    etcd_parse_end_array
+};
 
-etcd_node *etcd_node_create(void)
+etcd_node *etcd_node_create(etcd_arena *arena)
 {
     etcd_node *node;
     
-    if (!(node = malloc(sizeof(etcd_node))))
+    if (!(node = etcd_arena_alloc(arena, sizeof(etcd_node))))
         return NULL;
 
     node->isdir = 0;
@@ -111,21 +149,45 @@ etcd_node *etcd_node_create(void)
     node->snode = NULL;
     node->cnode = NULL;
     node->ccount = 0;
+    node->cfirst = -1;
 
     return node;
 }
 
-void etcd_node_destroy(etcd_node *node)
+/* Binary search for key among the children of a flattened dir */
+etcd_node *etcd_node_find(etcd_node *dir, const char *key)
 {
-    if (node) {
-        if (node->key) free(node->key); 
-        if (node->value) free(node->value);
-        if (node->snode) 
-            etcd_node_destroy(node->snode);
-        if (node->cnode)
-            etcd_node_destroy(node->cnode);
-        free(node);
+    long long lo = 0, hi, mid;
+    int cmp;
+
+    if (dir == NULL || dir->cfirst < 0) return NULL;
+
+    hi = dir->ccount - 1;
+    while (lo <= hi) {
+        mid = lo + (hi - lo) / 2;
+        cmp = strcmp(dir->cnode[mid].key, key);
+        if (cmp == 0) 
+            return &dir->cnode[mid];
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
     }
+    return NULL;
+}
+
+static long long etcd_node_count(etcd_node *node)
+{
+    long long n = 0;
+
+    for (; node; node = node->snode)
+        n += 1 + etcd_node_count(node->cnode);
+    return n;
+}
+
+static int etcd_node_cmp(const void *a, const void *b)
+{
+    return strcmp(((const etcd_node *)a)->key, ((const etcd_node *)b)->key);
 }
 
 etcd_response *etcd_response_create(void)
@@ -135,6 +197,11 @@ etcd_response *etcd_response_create(void)
     if ((resp = malloc(sizeof(etcd_response))) == NULL)
         return NULL;
 
+    resp->refcount = 1;
+    resp->data = NULL;
+    resp->cap = 0;
+    resp->parser = NULL;
+    etcd_arena_init(&resp->arena);
     etcd_response_init(resp);
     return resp;
 }
@@ -149,29 +216,109 @@ static inline void etcd_response_init(etcd_response *resp)
     resp->idx = -1;
     resp->ridx = -1;
     resp->rterm = -1;
-    resp->data[0] = '\0';
+    resp->len = 0;
+    if (resp->data) resp->data[0] = '\0';
     resp->action[0] = '\0';
     resp->node = NULL;
     resp->pnode = NULL;
+    resp->clienturl = NULL;
+    resp->nodes = NULL;
+    resp->nnodes = 0;
 }
 
-void etcd_response_cleanup(etcd_response *resp)
+/* Copies the parsed tree into one array, breadth first, so that the
+ * children of every dir are contiguous and sorted. The array doubles as
+ * the BFS queue: the cnode of a copied node still points into the parsed
+ * tree until its own turn comes. */
+static void etcd_response_flatten(etcd_response *resp)
 {
-    if (resp->node) 
-        etcd_node_destroy(resp->node);
+    etcd_node *nodes, *node, *child;
+    long long num, i, j, tail, sorted;
+
+    num = etcd_node_count(resp->node);
+    if ((nodes = etcd_arena_alloc(&resp->arena, sizeof(etcd_node) * num)) == NULL)
+        return; /* keep the linked tree */
+
+    nodes[0] = *resp->node;
+    nodes[0].snode = NULL;
+    tail = 1;
+    for (i = 0; i < tail; i++) {
+        node = &nodes[i];
+        if (node->cnode == NULL) continue;
+
+        sorted = 1;
+        for (child = node->cnode, j = tail; child; child = child->snode, j++) {
+            if (child->key == NULL) child->key = "";
+            nodes[j] = *child;
+            if (j > tail && sorted && strcmp(nodes[j - 1].key, child->key) > 0)
+                sorted = 0;
+        }
+        if (!sorted)
+            qsort(&nodes[tail], j - tail, sizeof(etcd_node), etcd_node_cmp);
+
+        node->cnode = &nodes[tail];
+        node->cfirst = tail;
+        node->ccount = j - tail;
+        for (; tail < j; tail++)
+            nodes[tail].snode = tail + 1 < j ? &nodes[tail + 1] : NULL;
+    }
+
+    resp->node = nodes;
+    resp->nodes = nodes;
+    resp->nnodes = num;
+}
 
-    if (resp->pnode)
-        etcd_node_destroy(resp->pnode);
+void etcd_response_cleanup(etcd_response *resp)
+{
+    if (resp->parser) {
+        etcd_parser_destroy(resp->parser);
+        resp->parser = NULL;
+    }
 
+    /* Nodes and strings all live in the arena */
+    etcd_arena_reset(&resp->arena);
     etcd_response_init(resp);
 }
 
+/* Keeps the response alive past its callback, e.g. for a future */
+etcd_response *etcd_response_retain(etcd_response *resp)
+{
+    __sync_add_and_fetch(&resp->refcount, 1);
+    return resp;
+}
+
+/* Drops a reference, the last one frees the response */
 void etcd_response_destroy(etcd_response *resp)
 {
+    if (__sync_sub_and_fetch(&resp->refcount, 1) > 0)
+        return;
+
     etcd_response_cleanup(resp);
+    etcd_arena_destroy(&resp->arena);
+    if (resp->data) free(resp->data);
     free(resp);
 }
 
+/* Makes room for size more bytes of body plus the terminating NUL */
+int etcd_response_reserve(etcd_response *resp, size_t size)
+{
+    size_t cap;
+    char *data;
+
+    if (resp->len + size < resp->cap)
+        return ETCD_OK;
+
+    cap = resp->cap ? resp->cap : ETCD_DATA_BUFSIZE;
+    while (cap <= resp->len + size)
+        cap <<= 1;
+
+    if ((data = realloc(resp->data, cap)) == NULL)
+        return ETCD_ERR;
+    resp->data = data;
+    resp->cap = cap;
+    return ETCD_OK;
+}
+
 size_t etcd_response_header_cb(char *buffer, size_t size, size_t nitems, 
     void *userdata)
 {
@@ -203,128 +350,310 @@ size_t etcd_response_write_cb(char *ptr, size_t size, size_t nmemb,
     void *userdata)
 {
     size_t ret_size = size * nmemb;
-    strncat(userdata, ptr, ret_size);
+    etcd_response *resp = userdata;
+
+    /* Parse as the bytes arrive, a failed parse is reported at the end */
+    if (resp->parser == NULL)
+        resp->parser = etcd_parser_create(resp);
+    if (resp->parser && resp->parser->status == yajl_status_ok) {
+        resp->parser->status = yajl_parse(resp->parser->h, 
+                (const unsigned char *)ptr, ret_size);
+        /* The tree holds everything, the raw body is not kept */
+        if (resp->parser->status == yajl_status_ok)
+            return ret_size;
+    }
+
+    /* A short count makes curl fail the transfer with CURLE_WRITE_ERROR */
+    if (etcd_response_reserve(resp, ret_size) != ETCD_OK)
+        return 0;
+
+    memcpy(resp->data + resp->len, ptr, ret_size);
+    resp->len += ret_size;
+    resp->data[resp->len] = '\0';
     return ret_size;
 }
 
 int etcd_response_parse(etcd_response *resp)
 {
-    yajl_val obj, val;
+    etcd_parser *p = resp->parser;
+    unsigned char *err;
 
-    obj = yajl_tree_parse(resp->data, resp->errmsg, sizeof(resp->errmsg));
-    if (!obj || !YAJL_IS_OBJECT(obj)) {
+    if (p == NULL) {
         resp->errcode = ETCD_ERR_PROTOCOL;
-        goto response_parse_done;
+        snprintf(resp->errmsg, sizeof(resp->errmsg), "empty response");
+        return resp->errcode;
     }
 
-    if (etcd_response_parse_err(resp, obj) == ETCD_OK)
-        goto response_parse_done;
-    
-    etcd_response_parse_key(obj, ETCD_RESP_KEY_ACTION, &resp->action, PF_STRCPY);
-
-    if (etcd_response_parse_key(obj, ETCD_RESP_KEY_NODE, &val, PF_NULL) == ETCD_OK)
-        resp->node = etcd_response_parse_node(val, 1); 
-    if (etcd_response_parse_key(obj, ETCD_RESP_KEY_PNODE, &val, PF_NULL) == ETCD_OK)
-        resp->pnode = etcd_response_parse_node(val, 1); 
+    if (p->status == yajl_status_ok)
+        p->status = yajl_complete_parse(p->h);
 
-    resp->errcode = ETCD_OK;
+    if (p->status != yajl_status_ok) {
+        err = yajl_get_error(p->h, 0, NULL, 0);
+        snprintf(resp->errmsg, sizeof(resp->errmsg), "%s", 
+                err ? (char *)err : "invalid response");
+        if (err) yajl_free_error(p->h, err);
+        resp->errcode = ETCD_ERR_PROTOCOL;
+    } else if (resp->node) {
+        etcd_response_flatten(resp);
+    }
 
-response_parse_done:
-    yajl_tree_free(obj);
+    etcd_parser_destroy(p);
+    resp->parser = NULL;
     return resp->errcode;
 }
 
-static int etcd_response_parse_err(etcd_response *resp, yajl_val obj)
+static etcd_parser *etcd_parser_create(etcd_response *resp)
 {
-    int ret;
-    ret = etcd_response_parse_key(obj, ETCD_RESP_KEY_ERRCODE, &resp->errcode, PF_NULL);
-    if (ret != ETCD_OK) return ret;
-    ret = etcd_response_parse_key(obj, ETCD_RESP_KEY_MESSAGE, &resp->errmsg, PF_STRCPY);
-    return ret;
+    etcd_parser *p;
+
+    if ((p = malloc(sizeof(etcd_parser))) == NULL)
+        return NULL;
+
+    p->frames = malloc(sizeof(etcd_parser_frame) * ETCD_PARSER_DEPTH);
+    p->h = yajl_alloc(&etcd_parse_callbacks, NULL, p);
+    if (p->frames == NULL || p->h == NULL) {
+        etcd_parser_destroy(p);
+        return NULL;
+    }
+
+    p->resp = resp;
+    p->status = yajl_status_ok;
+    p->key = ETCD_RESP_KEY_NONE;
+    p->skip = 0;
+    p->depth = 0;
+    p->maxdepth = ETCD_PARSER_DEPTH;
+    return p;
 }
 
-static etcd_node *etcd_response_parse_node(yajl_val obj, int parse_child)
+static void etcd_parser_destroy(etcd_parser *p)
 {
-    yajl_val val;
-    etcd_node *node;
+    if (p->h) yajl_free(p->h);
+    if (p->frames) free(p->frames);
+    free(p);
+}
+
+static etcd_parser_frame *etcd_parser_push(etcd_parser *p, int type, etcd_node *node)
+{
+    etcd_parser_frame *frame;
 
-    if ((node = etcd_node_create()) == NULL)
+    if (p->depth >= p->maxdepth) {
+        frame = realloc(p->frames, sizeof(etcd_parser_frame) * p->maxdepth * 2);
+        if (frame == NULL) return NULL;
+        p->frames = frame;
+        p->maxdepth *= 2;
+    }
+
+    frame = &p->frames[p->depth++];
+    frame->type = type;
+    frame->node = node;
+    frame->last = NULL;
+    return frame;
+}
+
+/* Called for every value, returns the enclosing frame or NULL if the
+ * value is to be ignored */
+static etcd_parser_frame *etcd_parser_value(etcd_parser *p)
+{
+    if (p->skip > 0 || p->depth == 0)
         return NULL;
+    return &p->frames[p->depth - 1];
+}
 
-    etcd_response_parse_key(obj, ETCD_RESP_KEY_KEY, &node->key, PF_NULL);
-    etcd_response_parse_key(obj, ETCD_RESP_KEY_VALUE, &node->value, PF_NULL);
-    etcd_response_parse_key(obj, ETCD_RESP_KEY_DIR, &node->isdir, PF_NULL);
-    etcd_response_parse_key(obj, ETCD_RESP_KEY_CIDX, &node->cidx, PF_LONG);
-    etcd_response_parse_key(obj, ETCD_RESP_KEY_MIDX, &node->midx, PF_LONG);
-    etcd_response_parse_key(obj, ETCD_RESP_KEY_TTL, &node->ttl, PF_NULL);
-    etcd_response_parse_key(obj, ETCD_RESP_KEY_EXPR, &node->expr, PF_STRCPY);
-
-    if (etcd_response_parse_key(obj, ETCD_RESP_KEY_NODES, &val, PF_NULL) == ETCD_OK) {
-
-        node->ccount = val->u.array.len;
-        if (parse_child) {
-            int i;
-            etcd_node *cnode, *pcnode;
-
-            cnode = pcnode = NULL;
-            for (i = 0; i < node->ccount; i++) {
-                cnode = etcd_response_parse_node(val->u.array.values[i], 0);
-                if (!cnode) continue;
-                if (i == 0) node->cnode = cnode;
-                if (pcnode) pcnode->snode = cnode;
-                pcnode = cnode; 
-            }
+static int etcd_parse_null(void *ctx)
+{
+    etcd_parser *p = ctx;
+
+    if (p->depth == 0) return 0;
+    p->key = ETCD_RESP_KEY_NONE;
+    return 1;
+}
+
+static int etcd_parse_boolean(void *ctx, int val)
+{
+    etcd_parser *p = ctx;
+    etcd_parser_frame *frame;
+
+    if (p->depth == 0) return 0;
+    frame = etcd_parser_value(p);
+    if (frame && frame->type == PF_NODE && p->key == ETCD_RESP_KEY_DIR)
+        frame->node->isdir = val ? 1 : 0;
+    p->key = ETCD_RESP_KEY_NONE;
+    return 1;
+}
+
+static int etcd_parse_integer(void *ctx, long long val)
+{
+    etcd_parser *p = ctx;
+    etcd_parser_frame *frame;
+
+    if (p->depth == 0) return 0;
+    if ((frame = etcd_parser_value(p)) == NULL) goto parse_integer_done;
+
+    if (frame->type == PF_ROOT) {
+        if (p->key == ETCD_RESP_KEY_ERRCODE)
+            p->resp->errcode = (long)val;
+    } else if (frame->type == PF_NODE) {
+        switch (p->key) {
+        case ETCD_RESP_KEY_CIDX: frame->node->cidx = val; break;
+        case ETCD_RESP_KEY_MIDX: frame->node->midx = val; break;
+        case ETCD_RESP_KEY_TTL: frame->node->ttl = (int)val; break;
+        default: break;
         }
     }
-    return node;
+
+parse_integer_done:
+    p->key = ETCD_RESP_KEY_NONE;
+    return 1;
 }
 
-static int etcd_response_parse_key(yajl_val obj, etcd_resp_key k, void *data, int flgs)
+static int etcd_parse_double(void *ctx, double val)
 {
-    yajl_val val;
-    yajl_type t = etcd_resp_key_type[k];
+    return etcd_parse_integer(ctx, (long long)val);
+}
 
-    val = yajl_tree_get(obj, etcd_resp_key_path[k], t);
-    if (!val) return ETCD_ERR_PROTOCOL;
+static int etcd_parse_string(void *ctx, const unsigned char *val, size_t len)
+{
+    etcd_parser *p = ctx;
+    etcd_parser_frame *frame;
+    etcd_response *resp = p->resp;
+    size_t n;
+
+    if (p->depth == 0) return 0;
+    if ((frame = etcd_parser_value(p)) == NULL) goto parse_string_done;
+
+    if (frame->type == PF_ROOT) {
+        if (p->key == ETCD_RESP_KEY_ACTION) {
+            n = len < sizeof(resp->action) ? len : sizeof(resp->action) - 1;
+            memcpy(resp->action, val, n);
+            resp->action[n] = '\0';
+        } else if (p->key == ETCD_RESP_KEY_MESSAGE) {
+            n = len < sizeof(resp->errmsg) ? len : sizeof(resp->errmsg) - 1;
+            memcpy(resp->errmsg, val, n);
+            resp->errmsg[n] = '\0';
+        }
+    } else if (frame->type == PF_NODE) {
+        etcd_node *node = frame->node;
+        switch (p->key) {
+        case ETCD_RESP_KEY_KEY:
+            if (!node->key) node->key = etcd_arena_strndup(&p->resp->arena, 
+                    (const char *)val, len);
+            break;
+        case ETCD_RESP_KEY_VALUE:
+            if (!node->value) node->value = etcd_arena_strndup(&p->resp->arena, 
+                    (const char *)val, len);
+            break;
+        case ETCD_RESP_KEY_EXPR:
+            n = len < sizeof(node->expr) ? len : sizeof(node->expr) - 1;
+            memcpy(node->expr, val, n);
+            node->expr[n] = '\0';
+            break;
+        default: 
+            break;
+        }
+    } else if (frame->type == PF_URLS) {
+        if (!resp->clienturl) resp->clienturl = etcd_arena_strndup(&resp->arena, 
+                (const char *)val, len);
+    }
 
-    switch (t) {
+parse_string_done:
+    p->key = ETCD_RESP_KEY_NONE;
+    return 1;
+}
 
-    case yajl_t_number:  
-        if (YAJL_IS_NUMBER(val)) {
-            if (flgs & PF_LONG) {
-                *((long long *)data) = YAJL_GET_INTEGER(val);
-            } else { 
-                *((int *)data) = (int)YAJL_GET_INTEGER(val);
-            }
-        }
-        break;
-
-    case yajl_t_string:
-        if (YAJL_IS_STRING(val)) {
-            const char *str = YAJL_GET_STRING(val);
-            if (flgs & PF_STRCPY) {
-                strcpy(*((char **)data), str);
-            } else {
-                *((char **)data) = strdup(str);
-            }
+static int etcd_parse_start_map(void *ctx)
+{
+    etcd_parser *p = ctx;
+    etcd_parser_frame *parent;
+    etcd_node *node;
+
+    if (p->depth == 0 && p->skip == 0)
+        return etcd_parser_push(p, PF_ROOT, NULL) != NULL;
+    if ((parent = etcd_parser_value(p)) == NULL) {
+        p->skip++;
+        return 1;
+    }
+
+    if (parent->type == PF_ROOT && (p->key == ETCD_RESP_KEY_NODE || 
+                p->key == ETCD_RESP_KEY_PNODE)) {
+        if ((node = etcd_node_create(&p->resp->arena)) == NULL) return 0;
+        if (p->key == ETCD_RESP_KEY_NODE)
+            p->resp->node = node;
+        else
+            p->resp->pnode = node;
+        if (etcd_parser_push(p, PF_NODE, node) == NULL) return 0;
+    } else if (parent->type == PF_NODES) {
+        if ((node = etcd_node_create(&p->resp->arena)) == NULL) return 0;
+        if (parent->last) 
+            parent->last->snode = node;
+        else
+            parent->node->cnode = node;
+        parent->last = node;
+        parent->node->ccount++;
+        if (etcd_parser_push(p, PF_NODE, node) == NULL) return 0;
+    } else {
+        p->skip++;
+    }
+
+    p->key = ETCD_RESP_KEY_NONE;
+    return 1;
+}
+
+static int etcd_parse_map_key(void *ctx, const unsigned char *key, size_t len)
+{
+    etcd_parser *p = ctx;
+    int i;
+
+    p->key = ETCD_RESP_KEY_NONE;
+    if (p->skip > 0) return 1;
+
+    for (i = 0; i < ETCD_RESP_KEY_NUM; i++) {
+        if (strlen(etcd_resp_key_name[i]) == len && 
+                memcmp(etcd_resp_key_name[i], key, len) == 0) {
+            p->key = (etcd_resp_key)i;
+            break;
         }
-        break;
+    }
+    return 1;
+}
 
-    case yajl_t_object:
-        if (YAJL_IS_OBJECT(val)) *((yajl_val *)data) = val; 
-        break;
+static int etcd_parse_end_map(void *ctx)
+{
+    etcd_parser *p = ctx;
+
+    if (p->skip > 0) 
+        p->skip--;
+    else
+        p->depth--;
+    p->key = ETCD_RESP_KEY_NONE;
+    return 1;
+}
 
-    case yajl_t_true:
-        *((int *)data) = YAJL_IS_TRUE(val) ? 1 : 0;
-        break;
+static int etcd_parse_start_array(void *ctx)
+{
+    etcd_parser *p = ctx;
+    etcd_parser_frame *parent;
+
+    /* The response itself must be an object */
+    if (p->depth == 0 && p->skip == 0) return 0;
+    if ((parent = etcd_parser_value(p)) == NULL) {
+        p->skip++;
+        return 1;
+    }
 
-    case yajl_t_array:
-        if (YAJL_IS_ARRAY(val)) *((yajl_val *)data) = val;
-        break;
+    if (parent->type == PF_NODE && p->key == ETCD_RESP_KEY_NODES) {
+        parent->node->ccount = 0;
+        if (etcd_parser_push(p, PF_NODES, parent->node) == NULL) return 0;
+    } else if (parent->type == PF_ROOT && p->key == ETCD_RESP_KEY_CURLS) {
+        if (etcd_parser_push(p, PF_URLS, NULL) == NULL) return 0;
+    } else {
+        p->skip++;
+    }
 
-    default:
-        return ETCD_ERR_PROTOCOL;
-    } 
+    p->key = ETCD_RESP_KEY_NONE;
+    return 1;
+}
 
-    return ETCD_OK;
+static int etcd_parse_end_array(void *ctx)
+{
+    return etcd_parse_end_map(ctx);
 }
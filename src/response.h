@@ -33,7 +33,9 @@
 
 #include <curl/curl.h>
 
-#define ETCD_DATA_BUFSIZE (1024*4)
+#include "arena.h"
+
+#define ETCD_DATA_BUFSIZE (1024*4) /* initial body buffer */
 #define ETCD_ERR_BUFSIZE 256
 
 #define ETCD_OK 0
@@ -41,6 +43,16 @@
 #define ETCD_ERR_CURL -2 /* CURL error */
 #define ETCD_ERR_PROTOCOL -3 /* Protocol error */
 #define ETCD_ERR_RESPONSE -4 /* Etcd response error */
+#define ETCD_ERR_CANCELED -5 /* Canceled by etcd_cancel */
+#define ETCD_ERR_TIMEOUT -6 /* Request deadline exceeded */
+#define ETCD_ERR_DROPPED -7 /* Dropped by a full queue */
+
+/* Etcd error codes, in errcode */
+#define ETCD_ERRCODE_KEY_NOT_FOUND 100
+#define ETCD_ERRCODE_TEST_FAILED 101 /* prevValue or prevIndex did not match */
+#define ETCD_ERRCODE_NODE_EXIST 105 /* prevExist=false on an existing key */
+#define ETCD_ERRCODE_RAFT_INTERNAL 300 /* transient, worth retrying */
+#define ETCD_ERRCODE_INDEX_CLEARED 401 /* waitIndex older than the event history */
 
 /* Etcd response headers */
 #define ETCD_HEADER_ECID "X-Etcd-Cluster-Id"
@@ -53,6 +65,8 @@
 #define ETCD_ACTION_CREATE "create"
 #define ETCD_ACTION_UPDATE "update"
 #define ETCD_ACTION_DELETE "delete"
+#define ETCD_ACTION_CAS "compareAndSwap"
+#define ETCD_ACTION_CAD "compareAndDelete"
 
 /* Etcd node structure */
 typedef struct etcd_node {
@@ -64,12 +78,14 @@ typedef struct etcd_node {
     char *key;
     char *value;
     long long ccount; /* number of childs */
+    long long cfirst; /* index of the first child in etcd_response.nodes */
     struct etcd_node *snode; /* sibling node */
-    struct etcd_node *cnode; /* child node */
+    struct etcd_node *cnode; /* child node, cnode[0..ccount) once flattened */
 } etcd_node;
 
 /* Etcd response structure */
-typedef struct {
+typedef struct etcd_response {
+    int refcount;
     CURLcode ccode; /* CURLcode */
     long hcode; /* http status code */
     long errcode; /* response error code */
@@ -80,17 +96,27 @@ typedef struct {
     long long ridx; /* raft index */
     long long rterm; /* raft term */
     /* response data */
-    char data[ETCD_DATA_BUFSIZE];
+    char *data; /* body from the first chunk the parser rejected, for the
+                   error report; empty when it parsed. NUL terminated. */
+    size_t len; /* length of data */
+    size_t cap; /* allocated size of data */
     char action[8];
     etcd_node *node;
     etcd_node *pnode; /* prev node */
+    etcd_node *nodes; /* whole node tree, breadth first, siblings sorted by key */
+    long long nnodes;
+    char *clienturl; /* first clientURLs entry of a members reply */
+    struct etcd_parser *parser; /* streaming parser, while receiving */
+    etcd_arena arena; /* nodes and their strings */
 } etcd_response;
 
-etcd_node *etcd_node_create(void);
-void etcd_node_destroy(etcd_node *node);
+etcd_node *etcd_node_create(etcd_arena *arena);
+etcd_node *etcd_node_find(etcd_node *dir, const char *key);
 etcd_response *etcd_response_create(void);
 void etcd_response_cleanup(etcd_response *resp);
+etcd_response *etcd_response_retain(etcd_response *resp);
 void etcd_response_destroy(etcd_response *resp);
+int etcd_response_reserve(etcd_response *resp, size_t size);
 size_t etcd_response_header_cb(char *buffer, size_t size, size_t nitems, void *userdata);
 size_t etcd_response_write_cb(char *ptr, size_t size, size_t nmemb, void *userdata);
 int etcd_response_parse(etcd_response *resp);
@@ -31,26 +31,35 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stddef.h>
+#include <time.h>
 #include <sys/time.h>
 
 #include "sev.h"
 #include "sev_impl.c"
+#include "sev_wheel.c"
 
-static inline void sev_time_now(long *sec, long *msec);
-static void sev_time_add2now(long long time_ms, long *sec, long *msec);
 static int sev_timer_cmp(sev_timer *tm, sev_timer *ts);
-static inline void sev_timer_swap(sev_timer **tm, sev_timer **ts);
+static inline void sev_timer_set(sev_pool *pool, long i, sev_timer *tm);
 static int sev_timers_resize(sev_pool *pool, int flgs);
-static void sev_timer_swap_up(sev_pool *pool, int i);
-static void sev_timer_swap_down(sev_pool *pool, int i);
-
-sev_pool *sev_pool_create(int size)
+static void sev_timer_swap_up(sev_pool *pool, long i);
+static void sev_timer_swap_down(sev_pool *pool, long i);
+static void sev_timer_update(sev_pool *pool, long i);
+static void sev_timer_remove(sev_pool *pool, sev_timer *tm);
+static void sev_timer_release(sev_pool *pool, sev_timer *tm);
+static sev_timer *sev_timer_alloc(sev_pool *pool);
+static void sev_timer_free(sev_pool *pool, sev_timer *tm);
+static sev_timer *sev_timer_get(sev_pool *pool, long long id);
+
+sev_pool *sev_pool_create(int size, int tmode)
 {
     sev_pool *pool;
     sev_timer **timers;
 
     if ((pool = malloc(sizeof(sev_pool))) == NULL) 
         goto create_err; 
+    pool->impl = NULL;
+    pool->twheel = NULL;
     pool->events = calloc(size, sizeof(sev_file_event));
     pool->ready = calloc(size, sizeof(sev_ready_event));
     if (pool->events == NULL || pool->ready == NULL) 
@@ -59,12 +68,19 @@ sev_pool *sev_pool_create(int size)
     pool->done = 0;
     pool->maxfd = -1; 
     pool->cron = NULL;
+    pool->data = NULL;
     if (sev_impl_create(pool) != SEV_OK)
         goto create_err;
 
     pool->tmaxid = 0;
     pool->tnum = 0;
     pool->tmaxnum = SEV_TIMER_DEFAULT_SIZE;
+    pool->tslabs = NULL;
+    pool->tslabnum = 0;
+    pool->tfree = -1;
+    pool->tmode = tmode;
+    if (tmode == SEV_TIMER_WHEEL && sev_wheel_create(pool) != SEV_OK)
+        goto create_err;
     if ((timers = calloc(pool->tmaxnum, sizeof(sev_timer*))) == NULL)
         goto create_err;
 
@@ -76,6 +92,8 @@ create_err:
     if (pool) {
         if (pool->events) free(pool->events);
         if (pool->ready) free(pool->ready);
+        if (pool->impl) sev_impl_destroy(pool);
+        if (pool->twheel) sev_wheel_destroy(pool);
         free(pool); 
     }
     return NULL;
@@ -87,6 +105,10 @@ void sev_pool_destroy(sev_pool *pool)
     if (pool->ready) free(pool->ready);
     if (pool->impl) sev_impl_destroy(pool);
     if (pool->timers) free(pool->timers);
+    if (pool->twheel) sev_wheel_destroy(pool);
+    while (pool->tslabnum > 0)
+        free(pool->tslabs[--pool->tslabnum]);
+    if (pool->tslabs) free(pool->tslabs);
     free(pool);
 }
 
@@ -121,48 +143,34 @@ void sev_del_event(sev_pool *pool, int fd, int flgs)
     }
 }
 
-static inline void sev_time_now(long *sec, long *msec)
+long long sev_time_ms(void)
 {
-    struct timeval tv;
+    struct timespec ts;
 
-    gettimeofday(&tv, NULL);
-    *sec = tv.tv_sec;
-    *msec = tv.tv_usec/1000;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-static void sev_time_add2now(long long time_ms, long *sec, long *msec)
+long long sev_time_us(void)
 {
-    sev_time_now(sec, msec);
-    *sec += time_ms / 1000;
-    *msec += time_ms % 1000;
-    if (*msec > 1000) {
-        *sec += 1;
-        *msec -= 1000; 
-    }
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
 /* [tm>ts,1|tm<ts,-1|tm==ts,0] */
 static int sev_timer_cmp(sev_timer *tm, sev_timer *ts)
 {
-    if (tm->sec == ts->sec) {
-        if (tm->msec == ts->msec)
-            return 0; 
-        else if (tm->msec > ts->msec)
-            return 1;
-        else
-            return -1;
-    } else if (tm->sec > ts->sec)
-        return 1; 
-    else 
-        return -1;
+    if (tm->when == ts->when)
+        return 0;
+    return tm->when > ts->when ? 1 : -1;
 }
 
-static inline void sev_timer_swap(sev_timer **tm, sev_timer **ts)
+static inline void sev_timer_set(sev_pool *pool, long i, sev_timer *tm)
 {
-    sev_timer *tmp;
-    tmp = *tm;
-    *tm = *ts; 
-    *ts = tmp;
+    pool->timers[i] = tm;
+    tm->index = i;
 }
 
 static int sev_timers_resize(sev_pool *pool, int flgs)
@@ -188,119 +196,223 @@ static int sev_timers_resize(sev_pool *pool, int flgs)
     return SEV_OK;
 }
 
-static void sev_timer_swap_up(sev_pool *pool, int i)
+static void sev_timer_swap_up(sev_pool *pool, long i)
 {
-    int j;
+    sev_timer *tm = pool->timers[i];
+    long j;
 
     for (; i > 0; i = j) {
         j = SEV_TIMER_PARENT(i);
-        if (sev_timer_cmp(pool->timers[i], pool->timers[j]) < 0)
-            sev_timer_swap(&pool->timers[i], &pool->timers[j]);
+        if (sev_timer_cmp(tm, pool->timers[j]) >= 0)
+            break;
+        sev_timer_set(pool, i, pool->timers[j]);
     }
+    sev_timer_set(pool, i, tm);
 }
 
-static void sev_timer_swap_down(sev_pool *pool, int i)
+static void sev_timer_swap_down(sev_pool *pool, long i)
 {
-    int j;
+    sev_timer *tm = pool->timers[i];
+    long j;
 
     for (;; i = j) {
-        j = SEV_TIMER_RIGHT(i);
-        if (j < pool->tnum) {
-            if (sev_timer_cmp(pool->timers[j-1], pool->timers[j]) < 0)    
-                j--;
-            if (sev_timer_cmp(pool->timers[i], pool->timers[j]) > 0)
-                sev_timer_swap(&pool->timers[i], &pool->timers[j]);
-        } else {
-            j = SEV_TIMER_LEFT(i); 
-            if (j < pool->tnum) {
-                if (sev_timer_cmp(pool->timers[i], pool->timers[j]) > 0)    
-                    sev_timer_swap(&pool->timers[i], &pool->timers[j]);
-            }
+        j = SEV_TIMER_LEFT(i);
+        if (j >= pool->tnum) break;
+        if (j + 1 < pool->tnum && 
+                sev_timer_cmp(pool->timers[j+1], pool->timers[j]) < 0)
+            j++;
+        if (sev_timer_cmp(tm, pool->timers[j]) <= 0)
             break;
+        sev_timer_set(pool, i, pool->timers[j]);
+    }
+    sev_timer_set(pool, i, tm);
+}
+
+/* Restores the heap after the timer at i changed its expiry */
+static void sev_timer_update(sev_pool *pool, long i)
+{
+    if (i > 0 && sev_timer_cmp(pool->timers[i], 
+                pool->timers[SEV_TIMER_PARENT(i)]) < 0)
+        sev_timer_swap_up(pool, i);
+    else
+        sev_timer_swap_down(pool, i);
+}
+
+static void sev_timer_remove(sev_pool *pool, sev_timer *tm)
+{
+    long i = tm->index;
+    sev_timer *last;
+
+    last = pool->timers[--pool->tnum];
+    pool->timers[pool->tnum] = NULL;
+    if (last != tm) {
+        sev_timer_set(pool, i, last);
+        sev_timer_update(pool, i);
+    }
+    tm->index = -1;
+
+    if (pool->tnum <= (pool->tmaxnum >> 2))
+        sev_timers_resize(pool, 0); 
+}
+
+/* Takes the timer out of whichever backend holds it */
+static void sev_timer_release(sev_pool *pool, sev_timer *tm)
+{
+    if (pool->tmode == SEV_TIMER_WHEEL) {
+        sev_wheel_del(pool, tm);
+        pool->tnum--;
+    } else {
+        sev_timer_remove(pool, tm);
+    }
+}
+
+static sev_timer *sev_timer_alloc(sev_pool *pool)
+{
+    sev_timer *tm, **tslabs;
+    long i, slot;
+
+    if (pool->tfree == -1) {
+        if ((pool->tslabnum + 1) * SEV_TIMER_SLAB_SIZE > SEV_TIMER_SLOT_MASK + 1)
+            return NULL;
+        tslabs = realloc(pool->tslabs, sizeof(sev_timer*) * (pool->tslabnum + 1));
+        if (tslabs == NULL) return NULL;
+        pool->tslabs = tslabs;
+        if ((tm = calloc(SEV_TIMER_SLAB_SIZE, sizeof(sev_timer))) == NULL)
+            return NULL;
+        pool->tslabs[pool->tslabnum] = tm;
+
+        slot = pool->tslabnum * SEV_TIMER_SLAB_SIZE;
+        for (i = SEV_TIMER_SLAB_SIZE - 1; i >= 0; i--) {
+            tm[i].index = -1;
+            sev_tlink_init(&tm[i].link);
+            tm[i].next = pool->tfree;
+            pool->tfree = slot + i;
         }
+        pool->tslabnum++;
     }
+
+    slot = pool->tfree;
+    tm = &pool->tslabs[slot / SEV_TIMER_SLAB_SIZE][slot % SEV_TIMER_SLAB_SIZE];
+    pool->tfree = tm->next;
+    tm->id = (++pool->tmaxid << SEV_TIMER_SLOT_BITS) | slot;
+    return tm;
+}
+
+static void sev_timer_free(sev_pool *pool, sev_timer *tm)
+{
+    long slot = tm->id & SEV_TIMER_SLOT_MASK;
+
+    tm->id = 0;
+    tm->proc = NULL;
+    tm->data = NULL;
+    tm->next = pool->tfree;
+    pool->tfree = slot;
+}
+
+/* O(1), the slot is encoded in the id */
+static sev_timer *sev_timer_get(sev_pool *pool, long long id)
+{
+    sev_timer *tm;
+    long slot;
+
+    if (id <= 0) return NULL;
+    slot = id & SEV_TIMER_SLOT_MASK;
+    if (slot >= pool->tslabnum * SEV_TIMER_SLAB_SIZE) return NULL;
+    tm = &pool->tslabs[slot / SEV_TIMER_SLAB_SIZE][slot % SEV_TIMER_SLAB_SIZE];
+    return tm->id == id ? tm : NULL;
 }
 
 long long sev_add_timer(sev_pool *pool, long long timeout_ms, 
         sev_timer_proc *proc, void *data)
 {
     sev_timer *timer;
-    int i;
 
-    if ((timer = malloc(sizeof(sev_timer))) == NULL)
-        return 0;
-
-    if (pool->tnum >= pool->tmaxnum) {
+    if (pool->tmode == SEV_TIMER_HEAP && pool->tnum >= pool->tmaxnum) {
         if (sev_timers_resize(pool, 1) != SEV_OK)
             return 0;
     }
 
-    timer->id = ++pool->tmaxid;
+    if ((timer = sev_timer_alloc(pool)) == NULL)
+        return 0;
+
     timer->proc = proc;
     timer->data = data;
-    sev_time_add2now(timeout_ms, &timer->sec, &timer->msec); 
+    timer->when = sev_time_ms() + timeout_ms;
 
-    i = pool->tnum;
-    pool->timers[pool->tnum++] = timer;
-    sev_timer_swap_up(pool, i);
+    pool->tnum++;
+    if (pool->tmode == SEV_TIMER_WHEEL) {
+        sev_wheel_add(pool, timer);
+    } else {
+        sev_timer_set(pool, pool->tnum - 1, timer);
+        sev_timer_swap_up(pool, pool->tnum - 1);
+    }
 
     return timer->id;
 }
 
 int sev_del_timer(sev_pool *pool, long long id)
 {
-    int i;
-    sev_timer *timer = NULL;
-
-    for (i = 0; i < pool->tnum; i++) {
-        if (pool->timers[i]->id == id) {
-            timer = pool->timers[i];
-            break;
-        } 
-    }
-    if (timer == NULL) return SEV_ERR;
+    sev_timer *timer;
 
-    if (i != (pool->tnum - 1))
-        sev_timer_swap(&pool->timers[i], &pool->timers[pool->tnum - 1]);
+    if ((timer = sev_timer_get(pool, id)) == NULL) 
+        return SEV_ERR;
 
-    pool->tnum--;
-    free(pool->timers[pool->tnum]);
-    pool->timers[pool->tnum] = NULL;
+    sev_timer_release(pool, timer);
+    sev_timer_free(pool, timer);
+    return SEV_OK;
+}
 
-    if (pool->timers[i] != NULL) {
-        timer = pool->timers[i];
-        if (i == 0) {
-            sev_timer_swap_down(pool, i);
-        } else {
-            if (sev_timer_cmp(timer, pool->timers[SEV_TIMER_PARENT(i)]) > 0) {
-                sev_timer_swap_down(pool, i);
-            } else {
-                sev_timer_swap_up(pool, i); 
-            }
-        }
-    }
+/* Reschedules a pending timer in place, keeping its id */
+int sev_mod_timer(sev_pool *pool, long long id, long long timeout_ms)
+{
+    sev_timer *timer;
 
-    if (pool->tnum <= (pool->tmaxnum >> 2))
-        sev_timers_resize(pool, 0); 
+    if ((timer = sev_timer_get(pool, id)) == NULL) 
+        return SEV_ERR;
 
+    timer->when = sev_time_ms() + timeout_ms;
+    if (pool->tmode == SEV_TIMER_WHEEL) {
+        sev_wheel_del(pool, timer);
+        sev_wheel_add(pool, timer);
+    } else {
+        sev_timer_update(pool, timer->index);
+    }
     return SEV_OK;
 }
 
 int sev_process_timer(sev_pool *pool)
 {
     sev_timer *tm;
-    long sec, msec;
+    sev_timer_proc *proc;
+    sev_tlink expired;
+    void *data;
+    long long id, now;
     int num = 0;
 
-    while (pool->timers[0] != NULL) {
-        tm = pool->timers[0];
-        sev_time_now(&sec, &msec);
+    now = sev_time_ms();
+    if (pool->tmode == SEV_TIMER_WHEEL) {
+        sev_tlink_init(&expired);
+        sev_wheel_expire(pool, now, &expired);
+    }
+
+    while (pool->tnum > 0) {
+        if (pool->tmode == SEV_TIMER_WHEEL) {
+            /* Handlers may delete timers still on the expired list */
+            if (sev_tlink_empty(&expired)) break;
+            tm = sev_tlink_gettimer(expired.next);
+        } else {
+            tm = pool->timers[0];
+            if (tm->when > now) break;
+        }
 
-        if ((sec == tm->sec && msec < tm->msec) || sec < tm->sec)
-            break;
+        /* Released before the call, so the handler may add or delete timers */
+        id = tm->id;
+        proc = tm->proc;
+        data = tm->data;
+        sev_timer_release(pool, tm);
+        sev_timer_free(pool, tm);
 
-        if (tm->proc != NULL) tm->proc(pool, tm->id, tm->data);
-        sev_del_timer(pool, tm->id);
+        if (proc != NULL) proc(pool, id, data);
         num++;
     }
     return num;
@@ -39,7 +39,19 @@
 #define SEV_W 2 /* Writable event flag */
 
 #define SEV_TIMER_DEFAULT_SIZE (1<<7) /* 128, 1k */
-#define SEV_TIMER_MAX_SIZE (1<<17) /* 131072, 1m */  
+#define SEV_TIMER_MAX_SIZE (1<<SEV_TIMER_SLOT_BITS) /* 1048576, as many as ids can address */
+#define SEV_TIMER_SLAB_SIZE (1<<7) /* timers per slab chunk */
+#define SEV_TIMER_SLOT_BITS 20 /* low bits of a timer id hold its slab slot */
+#define SEV_TIMER_SLOT_MASK ((1LL<<SEV_TIMER_SLOT_BITS)-1)
+
+/* Timer backends */
+#define SEV_TIMER_HEAP 0 /* binary heap, O(log n) add/del */
+#define SEV_TIMER_WHEEL 1 /* hierarchical timing wheel, O(1) add/del */
+
+#define SEV_WHEEL_BITS 6
+#define SEV_WHEEL_SIZE (1<<SEV_WHEEL_BITS) /* slots per level */
+#define SEV_WHEEL_MASK (SEV_WHEEL_SIZE-1)
+#define SEV_WHEEL_LEVELS 4 /* 1ms ticks, up to 2^24 ms (~4.6h) ahead */
 
 #define SEV_TIMER_PARENT(i) (((i)+1)/2-1)
 #define SEV_TIMER_LEFT(i) ((i)*2+1)
@@ -71,11 +83,19 @@ typedef struct {
     int flgs;
 } sev_ready_event;
 
+/* Timer list link */
+typedef struct sev_tlink {
+    struct sev_tlink *prev;
+    struct sev_tlink *next;
+} sev_tlink;
+
 /* Timer structure */
 typedef struct {
-    long sec;
-    long msec;
-    long long id; /* timer id */
+    long long when; /* expiry, monotonic ms */
+    long long id; /* timer id, 0 when the slot is free */
+    long index; /* position in the heap */
+    long next; /* next free slot */
+    sev_tlink link; /* wheel slot list */
     sev_timer_proc *proc; 
     void *data;
 } sev_timer;
@@ -85,24 +105,33 @@ typedef struct sev_pool {
     int done;
     int size;
     int maxfd;
+    int tmode; /* timer backend */
     long tnum; /* number of timers */
     long tmaxnum;
     long long tmaxid; /* max timer id */
     sev_timer **timers;
+    sev_timer **tslabs; /* timer storage, SEV_TIMER_SLAB_SIZE per chunk */
+    long tslabnum; /* number of slab chunks */
+    long tfree; /* first free slot, -1 if none */
+    void *twheel; /* timing wheel, SEV_TIMER_WHEEL only */
     void *impl; /* polling implementation */
     sev_file_event *events;
     sev_ready_event *ready;
     sev_cron_proc *cron; 
+    void *data; /* user data */
 } sev_pool;
 
-sev_pool *sev_pool_create(int size);
+sev_pool *sev_pool_create(int size, int tmode);
 void sev_pool_destroy(sev_pool *pool);
 int sev_add_event(sev_pool *pool, int fd, int flgs, sev_file_proc *proc, void *data);
 void sev_del_event(sev_pool *pool, int fd, int flgs);
 long long sev_add_timer(sev_pool *pool, long long timeout_ms, sev_timer_proc *proc, void *data);
 int sev_del_timer(sev_pool *pool, long long id);
+int sev_mod_timer(sev_pool *pool, long long id, long long timeout_ms);
 int sev_process_timer(sev_pool *pool);
 int sev_process_event(sev_pool *pool, struct timeval *tvp);
 void sev_dispatch(sev_pool *pool, struct timeval *tvp);
+long long sev_time_ms(void);
+long long sev_time_us(void);
 
 #endif
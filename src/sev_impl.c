@@ -98,20 +98,21 @@ static void sev_impl_del(sev_pool *pool, int fd, int flgs)
 {
     sev_impl *impl = pool->impl;
     struct epoll_event ee;
-    int op;
+    int op, mask = pool->events[fd].flgs & (~flgs);
     
+    /* Keep polling for what is left */
     ee.events = 0;
-    if (flgs & SEV_R) ee.events |= EPOLLIN;
-    if (flgs & SEV_W) ee.events |= EPOLLOUT;
+    if (mask & SEV_R) ee.events |= EPOLLIN;
+    if (mask & SEV_W) ee.events |= EPOLLOUT;
     ee.data.u64 = 0;
     ee.data.fd = fd;
 
-    if ((pool->events[fd].flgs & (~flgs)) == SEV_N)
+    if (mask == SEV_N)
         op = EPOLL_CTL_DEL;
     else
         op = EPOLL_CTL_MOD;
 
-    epoll_ctl(impl->epfd, EPOLL_CTL_MOD, fd, &ee);
+    epoll_ctl(impl->epfd, op, fd, &ee);
 }
 
 static int sev_impl_poll(sev_pool *pool, struct timeval *tvp)
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2014-2015, Qingbin Piao <piaoqingbin at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Hierarchical timing wheel with 1ms ticks. Level n slot i holds the timers
+ * expiring in the i-th 64^n ms block; a level is cascaded into the one below
+ * whenever the lower level wraps around. */
+
+#define sev_tlink_init(l)           \
+    (l)->prev = (l);                \
+    (l)->next = (l)
+
+#define sev_tlink_empty(l)  ((l) == (l)->next)
+#define sev_tlink_gettimer(l) \
+    ((sev_timer *)((char *)(l)-offsetof(sev_timer, link)))
+
+typedef struct {
+    long long tick; /* next tick to expire */
+    sev_tlink slots[SEV_WHEEL_LEVELS][SEV_WHEEL_SIZE];
+} sev_wheel;
+
+static inline void sev_tlink_append(sev_tlink *h, sev_tlink *l)
+{
+    l->prev = h->prev;
+    l->next = h;
+    h->prev->next = l;
+    h->prev = l;
+}
+
+static inline void sev_tlink_remove(sev_tlink *l)
+{
+    l->next->prev = l->prev;
+    l->prev->next = l->next;
+    sev_tlink_init(l);
+}
+
+static int sev_wheel_create(sev_pool *pool)
+{
+    sev_wheel *wheel;
+    int i, j;
+
+    if ((wheel = malloc(sizeof(sev_wheel))) == NULL)
+        return SEV_ERR;
+
+    wheel->tick = sev_time_ms();
+    for (i = 0; i < SEV_WHEEL_LEVELS; i++) {
+        for (j = 0; j < SEV_WHEEL_SIZE; j++) {
+            sev_tlink_init(&wheel->slots[i][j]);
+        }
+    }
+
+    pool->twheel = wheel;
+    return SEV_OK;
+}
+
+static void sev_wheel_destroy(sev_pool *pool)
+{
+    free(pool->twheel);
+    pool->twheel = NULL;
+}
+
+static void sev_wheel_add(sev_pool *pool, sev_timer *tm)
+{
+    sev_wheel *wheel = pool->twheel;
+    long long when = tm->when, delta;
+    int level;
+
+    if (when < wheel->tick) when = wheel->tick;
+    delta = when - wheel->tick;
+
+    for (level = 0; level < SEV_WHEEL_LEVELS - 1; level++) {
+        if (delta < (1LL << (SEV_WHEEL_BITS * (level + 1))))
+            break;
+    }
+    if (delta >= (1LL << (SEV_WHEEL_BITS * SEV_WHEEL_LEVELS))) {
+        /* Parked in the farthest slot, re-filed when it cascades */
+        when = wheel->tick + (1LL << (SEV_WHEEL_BITS * SEV_WHEEL_LEVELS)) - 1;
+    }
+
+    sev_tlink_append(&wheel->slots[level]
+            [(when >> (SEV_WHEEL_BITS * level)) & SEV_WHEEL_MASK], &tm->link);
+}
+
+static inline void sev_wheel_del(sev_pool *pool, sev_timer *tm)
+{
+    (void)pool;
+    sev_tlink_remove(&tm->link);
+}
+
+static void sev_wheel_cascade(sev_pool *pool, int level)
+{
+    sev_wheel *wheel = pool->twheel;
+    sev_tlink *h, *l;
+
+    h = &wheel->slots[level]
+        [(wheel->tick >> (SEV_WHEEL_BITS * level)) & SEV_WHEEL_MASK];
+    while (!sev_tlink_empty(h)) {
+        l = h->next;
+        sev_tlink_remove(l);
+        sev_wheel_add(pool, sev_tlink_gettimer(l));
+    }
+}
+
+/* Moves every timer due at or before now onto the expired list */
+static void sev_wheel_expire(sev_pool *pool, long long now, sev_tlink *expired)
+{
+    sev_wheel *wheel = pool->twheel;
+    sev_tlink *h;
+    int level;
+
+    if (pool->tnum == 0) {
+        if (wheel->tick <= now) wheel->tick = now + 1;
+        return;
+    }
+
+    while (wheel->tick <= now) {
+        for (level = 1; level < SEV_WHEEL_LEVELS; level++) {
+            if ((wheel->tick >> (SEV_WHEEL_BITS * (level - 1))) & SEV_WHEEL_MASK)
+                break;
+            sev_wheel_cascade(pool, level);
+        }
+
+        h = &wheel->slots[0][wheel->tick & SEV_WHEEL_MASK];
+        if (!sev_tlink_empty(h)) {
+            /* Splice the whole slot */
+            h->next->prev = expired->prev;
+            expired->prev->next = h->next;
+            h->prev->next = expired;
+            expired->prev = h->prev;
+            sev_tlink_init(h);
+        }
+        wheel->tick++;
+    }
+}
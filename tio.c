@@ -39,7 +39,7 @@ void etcd_response_print(etcd_response *resp)
     printf("resp_action:%s\n", resp->action);
     printf("resp_node:%d\n", resp->node ? 1 : 0);
     printf("resp_pnode:%d\n", resp->pnode ? 1 : 0);
-    printf("resp_data:%s\n", resp->data);
+    printf("resp_data:%s\n", resp->data ? resp->data : "");
     etcd_node_print(resp->node, "node", 1);
     etcd_node_print(resp->pnode, "pnode", 1);
 }
@@ -55,24 +55,24 @@ int main(void) {
 
     etcd_client *client = etcd_client_create(); 
     etcd_set_log_level(ETCD_LOG_LEVEL_DEBUG);
-    client->servers[0] = "http://10.69.56.43:2379";
+    etcd_add_server(client, "http://10.69.56.43:2379");
     etcd_set_response_proc(client, proc, "test_data_haha");
 
-    //etcd_amkdir(client, "/test/key1", 0);
-    //etcd_amkdir(client, "/test/key2", 1000);
+    //etcd_amkdir(client, "/test/key1", 0, NULL, NULL);
+    //etcd_amkdir(client, "/test/key2", 1000, NULL, NULL);
 
     const char *v1 = "hahah_v1";
-    //etcd_aset(client, "/test/key1/tn1", v1, sizeof(v1), 100);
-    //etcd_aset(client, "/test/key1/tn2", v1, sizeof(v1), 0);
+    //etcd_aset(client, "/test/key1/tn1", v1, sizeof(v1), 100, NULL, NULL);
+    //etcd_aset(client, "/test/key1/tn2", v1, sizeof(v1), 0, NULL, NULL);
 
     sleep(1);
 
-    //etcd_aget(client, "/test/key1/tn1");
-    //etcd_aget(client, "/test");
+    //etcd_aget(client, "/test/key1/tn1", NULL, NULL);
+    //etcd_aget(client, "/test", NULL, NULL);
     //
-    //etcd_adelete(client, "/test/key1/tn1");
+    //etcd_adelete(client, "/test/key1/tn1", NULL, NULL);
 
-    etcd_awatch(client, "/test");
+    etcd_awatch(client, "/test", NULL, NULL);
 
     sleep(60);
 